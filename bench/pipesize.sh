@@ -0,0 +1,41 @@
+#!/bin/bash
+# Pipe buffer size benchmark: runs the same multi-stage pipelines through s3 with different
+# pipesize= settings and prints the throughput of each.
+#
+# Usage: bench/pipesize.sh [size_mb] [repeats]     (run from the project directory, after gcc)
+#   S3=./s3 SIZES="0 256K 1M" bench/pipesize.sh 512 5
+
+S3=${S3:-./s3}
+SIZE_MB=${1:-256}
+REPEATS=${2:-3}
+SIZES=${SIZES:-"0 128K 256K 512K 1M"}   # 0 = kernel default (64K)
+
+DATA=$(mktemp /tmp/s3-pipesize.XXXXXX)
+trap 'rm -f "$DATA"' EXIT
+
+# Text data, so that tr/grep/sort have something realistic to chew on
+head -c $((SIZE_MB * 1024 * 1024 * 3 / 4)) /dev/urandom | base64 -w 100 > "$DATA"
+BYTES=$(stat -c %s "$DATA")
+
+PIPELINES=(
+    "tr a-z A-Z < $DATA | tr A-Z a-z | cat | cat > /dev/null"
+    "grep -v zzzz < $DATA | tr 0-9 a-j | tac | wc -l > /dev/null"
+)
+
+TIMEFORMAT=%R
+printf "%d MiB of input, best of %d runs\n\n" $((BYTES / 1024 / 1024)) "$REPEATS"
+for pipeline in "${PIPELINES[@]}"; do
+    echo "${pipeline//$DATA/data}"
+    for size in $SIZES; do
+        best=""
+        for ((run = 0; run < REPEATS; run++)); do
+            seconds=$( { time "$S3" "pipesize=$size $pipeline" > /dev/null; } 2>&1 )
+            if [ -z "$best" ] || awk "BEGIN { exit !($seconds < $best) }"; then
+                best=$seconds
+            fi
+        done
+        awk -v size="$size" -v s="$best" -v b="$BYTES" \
+            'BEGIN { printf "  pipesize=%-5s %7.3f s  %8.1f MiB/s\n", size, s, b / 1048576 / s }'
+    done
+    echo
+done
@@ -0,0 +1,116 @@
+#!/bin/bash
+# End-to-end launch benchmark: runs the same generated scripts through s3, dash and bash and
+# reports the cost of each launch path.
+#
+#   spawn      N lines of "/bin/true"                             (commands per second)
+#   pipeline   "/bin/true | /bin/cat | ... | /bin/cat", 1..64 stages (latency per pipeline)
+#   batch      one line of N ';'-separated "/bin/true"            (commands per second)
+#   subshell   "( ( ... /bin/true ... ) )", 1..16 levels deep     (latency per line)
+#   redirect   "/bin/true < /dev/null > file", ">> file"          (latency per command)
+#
+# Usage: bench/shells.sh [-j] [repeats]      (run from the project directory, after gcc)
+#   -j          one JSON object per result instead of a table
+#   SHELLS="./s3 dash" N=2000 bench/shells.sh
+#
+# Every result is the best of [repeats] runs (default 3). External programs are called by
+# absolute path so that no shell gets to use a builtin or skip the $PATH search.
+
+JSON=0
+if [ "$1" = "-j" ]; then
+    JSON=1
+    shift
+fi
+REPEATS=${1:-3}
+N=${N:-1000}                 # lines (or commands) per spawn/batch/redirect run
+LINES=${LINES_PER_RUN:-200}  # lines per pipeline/subshell run
+SHELLS=${SHELLS:-"./s3 dash bash"}
+
+WORK=$(mktemp -d /tmp/s3-bench.XXXXXX)
+trap 'rm -rf "$WORK"' EXIT
+
+# Writes "$2" to the script file $1, $3 times (one command line per line)
+repeat_line() {
+    local i
+    for ((i = 0; i < $3; i++)); do
+        echo "$2"
+    done > "$1"
+}
+
+# Runs script $2 with shell $1, best of REPEATS, prints the elapsed seconds
+best_time() {
+    local shell=$1 script=$2 best="" run start end
+    local args=("$script")
+    [ "$(basename "$shell")" = s3 ] && args=(-s "$script")
+    for ((run = 0; run < REPEATS; run++)); do
+        start=$(date +%s%N)
+        "$shell" "${args[@]}" > /dev/null 2>&1
+        end=$(date +%s%N)
+        if [ -z "$best" ] || [ $((end - start)) -lt "$best" ]; then
+            best=$((end - start))
+        fi
+    done
+    awk -v ns="$best" 'BEGIN { printf "%.6f", ns / 1e9 }'
+}
+
+# report shell test param ops seconds: prints one result, per-op time and rate
+report() {
+    awk -v shell="$(basename "$1")" -v test="$2" -v param="$3" -v ops="$4" -v s="$5" -v json="$JSON" '
+        BEGIN {
+            us = s * 1e6 / ops
+            if (json) {
+                printf "{\"shell\":\"%s\",\"test\":\"%s\",\"param\":%d,\"ops\":%d,\"seconds\":%.6f,\"us_per_op\":%.2f,\"ops_per_s\":%.1f}\n",
+                       shell, test, param, ops, s, us, ops / s
+            } else {
+                printf "%-6s %-10s %6d %8d %10.4f %12.2f %12.1f\n", shell, test, param, ops, s, us, ops / s
+            }
+        }'
+}
+
+if [ "$JSON" = 0 ]; then
+    printf "%-6s %-10s %6s %8s %10s %12s %12s\n" shell test param ops seconds us/op ops/s
+fi
+
+# Build every script once, so all shells run exactly the same input
+repeat_line "$WORK/spawn" "/bin/true" "$N"
+
+for depth in 1 2 4 8 16 32 64; do
+    line="/bin/true"
+    for ((i = 1; i < depth; i++)); do
+        line="$line | /bin/cat"
+    done
+    repeat_line "$WORK/pipeline.$depth" "$line > /dev/null" "$LINES"
+done
+
+line="/bin/true"
+for ((i = 1; i < N; i++)); do
+    line="$line; /bin/true"
+done
+echo "$line" > "$WORK/batch"
+
+for depth in 1 2 4 8 16; do
+    line="/bin/true"
+    for ((i = 0; i < depth; i++)); do
+        line="( $line )"
+    done
+    repeat_line "$WORK/subshell.$depth" "$line" "$LINES"
+done
+
+repeat_line "$WORK/redirect.0" "/bin/true < /dev/null > $WORK/out" "$N"
+repeat_line "$WORK/redirect.1" "/bin/true >> $WORK/out" "$N"
+
+for shell in $SHELLS; do
+    if ! command -v "$shell" > /dev/null; then
+        echo "$shell: not found, skipped" >&2
+        continue
+    fi
+    report "$shell" spawn 0 "$N" "$(best_time "$shell" "$WORK/spawn")"
+    for depth in 1 2 4 8 16 32 64; do
+        report "$shell" pipeline "$depth" "$LINES" "$(best_time "$shell" "$WORK/pipeline.$depth")"
+    done
+    report "$shell" batch 0 "$N" "$(best_time "$shell" "$WORK/batch")"
+    for depth in 1 2 4 8 16; do
+        report "$shell" subshell "$depth" "$LINES" "$(best_time "$shell" "$WORK/subshell.$depth")"
+    done
+    report "$shell" redirect 0 "$N" "$(best_time "$shell" "$WORK/redirect.0")"  # < and >
+    report "$shell" redirect 1 "$N" "$(best_time "$shell" "$WORK/redirect.1")"  # >>
+done
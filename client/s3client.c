@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+//Client for s3 server mode: runs each argument as a command line in one session of
+//./s3 --serve SOCKET, with this process's stdin/stdout/stderr, and exits with the status
+//of the last one. "cd" and other shell state carry over between the arguments.
+//
+//Build and run from the project directory:
+//  gcc -O2 -Wall client/s3client.c -o s3client
+//  ./s3 --serve /tmp/s3.sock &
+//  ./s3client /tmp/s3.sock "cd txt" "sort phrases.txt | uniq -c" 'echo $?'
+//
+//Protocol (SOCK_SEQPACKET, one message per frame): the client sends a command line with
+//its three fds attached as SCM_RIGHTS; the server answers {kind, value} pairs of ints:
+//kind 0 = the command line finished with status value, kind 1 = the session ended
+//(after "exit") with status value.
+
+enum ServerFrameKind
+{
+    SERVER_STATUS,
+    SERVER_EXIT,
+};
+
+struct server_frame
+{
+    int kind;
+    int value;
+};
+
+//Sends one command line with stdin, stdout and stderr attached. Returns 0 on failure.
+static int send_line(int sock, const char *line)
+{
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+
+    struct iovec iov = { .iov_base = (void *) line, .iov_len = strlen(line) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t) iov.iov_len;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s SOCKET 'command line' ...\n", argv[0]);
+        return 2;
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", argv[1]);
+        return 2;
+    }
+    strcpy(addr.sun_path, argv[1]);
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock == -1 || connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror(argv[1]);
+        return 2;
+    }
+
+    int status = 0;
+    for (int i = 2; i < argc; i++) {
+        if (!send_line(sock, argv[i])) {
+            perror("send failed");
+            return 2;
+        }
+
+        struct server_frame frame;
+        ssize_t length = recv(sock, &frame, sizeof(frame), 0);
+        if (length != sizeof(frame)) {
+            fprintf(stderr, "s3client: server closed the connection\n");
+            return 2;
+        }
+        status = frame.value;
+        if (frame.kind == SERVER_EXIT) {
+            break; //"exit": the session is over, the rest is not run
+        }
+    }
+    close(sock);
+    return status;
+}
@@ -0,0 +1,303 @@
+#include "../s3.h"
+
+//Parser harness: runs parse_line() from s3.c without the shell around it.
+//
+//Build and run from the project directory:
+//  gcc -O2 -Wall fuzz/parse_harness.c s3.c -o parse_harness
+//  ./parse_harness                  ns per line for each kind of line in a generated corpus
+//  ./parse_harness -w fuzz/corpus   writes that corpus out, one file per line (fuzzer seeds)
+//  ./parse_harness FILE...          parses each file as one line (AFL: ./parse_harness @@)
+//
+//As a libFuzzer target:
+//  clang -g -O1 -fsanitize=fuzzer,address -DLIBFUZZER fuzz/parse_harness.c s3.c -o parse_fuzz
+//  ./parse_fuzz fuzz/corpus
+//
+//Every tree that parses is checked for consistency (counts match the children, argv is
+//NULL terminated, ...), and abort()s if it is not, so the fuzzer finds wrong trees as well
+//as crashes.
+
+static struct arena arena;
+
+//Checks the invariants the executor relies on; abort()s on the first one that fails
+static void check_tree(struct command_node *node)
+{
+    int count = 0;
+    switch (node->type) {
+    case NODE_LIST:
+    case NODE_PIPELINE:
+        for (struct command_node *child = node->children; child != NULL; child = child->next) {
+            if (child->type != (node->type == NODE_LIST ? NODE_PIPELINE : NODE_COMMAND)
+                && !(node->type == NODE_PIPELINE && child->type == NODE_SUBSHELL)) {
+                abort();
+            }
+            check_tree(child);
+            count++;
+        }
+        if (count != node->count || (node->type == NODE_PIPELINE && count == 0)) {
+            abort();
+        }
+        break;
+    case NODE_SUBSHELL:
+        if (node->children == NULL || node->children->type != NODE_LIST || node->children->count == 0) {
+            abort();
+        }
+        check_tree(node->children);
+        break;
+    case NODE_COMMAND:
+        if (node->count <= 0 || node->argv == NULL || node->argv[node->count] != NULL) {
+            abort();
+        }
+        for (int i = 0; i < node->count; i++) {
+            if (node->argv[i] == NULL) {
+                abort();
+            }
+        }
+        break;
+    }
+    for (struct redirection *redir = node->redirs; redir != NULL; redir = redir->next) {
+        if (redir->file == NULL) {
+            abort();
+        }
+    }
+}
+
+//Parses one NUL-terminated line and checks the result
+static void parse_one(const char *line)
+{
+    struct command_node *tree = parse_line(line, &arena);
+    if (tree) {
+        check_tree(tree);
+    }
+    arena_reset(&arena);
+}
+
+//Parses size bytes of arbitrary data as one line (stops at an embedded NUL, like the shell)
+static void parse_bytes(const char *data, size_t size)
+{
+    char *line = malloc(size + 1);
+    if (!line) {
+        perror("malloc failed");
+        exit(1);
+    }
+    memcpy(line, data, size);
+    line[size] = '\0';
+    parse_one(line);
+    free(line);
+}
+
+#ifdef LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const char *data, size_t size)
+{
+    static int quiet = 0;
+    if (!quiet) { //syntax errors are expected, don't let them flood the fuzzer's output
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDERR_FILENO);
+        quiet = 1;
+    }
+    parse_bytes(data, size);
+    return 0;
+}
+
+#else
+
+/**
+ * Corpus
+ *
+ * Each kind of line is built by a function that appends it to a growable buffer, so the
+ * pathological ones can be made as large as needed.
+ */
+struct buffer {
+    char *text;
+    size_t length;
+    size_t capacity;
+};
+
+static void append(struct buffer *buf, const char *text)
+{
+    size_t len = strlen(text);
+    if (buf->length + len + 1 > buf->capacity) {
+        buf->capacity = (buf->length + len + 1) * 2;
+        buf->text = realloc(buf->text, buf->capacity);
+        if (!buf->text) {
+            perror("malloc failed");
+            exit(1);
+        }
+    }
+    memcpy(buf->text + buf->length, text, len + 1);
+    buf->length += len;
+}
+
+static void simple_line(struct buffer *buf)
+{
+    append(buf, "ls -la /tmp");
+}
+
+static void realistic_line(struct buffer *buf)
+{
+    append(buf, "cd txt ; cat phrases.txt | grep -v foo | sort -r | uniq -c > ../out.txt && echo \"done $?\" || echo failed");
+}
+
+static void redirect_line(struct buffer *buf)
+{
+    append(buf, "sort < in.txt > out.txt ; wc -l < out.txt >> log.txt ; (ls ; pwd) > dirs.txt");
+}
+
+static void quoted_line(struct buffer *buf)
+{
+    append(buf, "printf '%s\\n' \"");
+    for (int i = 0; i < 65536 / 8; i++) {
+        append(buf, "a b|c;d ");
+    }
+    append(buf, "\" 'single quoted; (not) a | pipe'");
+}
+
+static void deep_parens_line(struct buffer *buf)
+{
+    for (int i = 0; i < MAX_SUBSHELL_DEPTH; i++) {
+        append(buf, "( echo x ; ");
+    }
+    append(buf, "true");
+    for (int i = 0; i < MAX_SUBSHELL_DEPTH; i++) {
+        append(buf, " )");
+    }
+}
+
+static void too_deep_line(struct buffer *buf)
+{
+    for (int i = 0; i < MAX_SUBSHELL_DEPTH * 100; i++) {
+        append(buf, "(");
+    }
+}
+
+static void many_pipes_line(struct buffer *buf)
+{
+    append(buf, "cat big");
+    for (int i = 0; i < 5000; i++) {
+        append(buf, " | tr a b");
+    }
+}
+
+static void long_list_line(struct buffer *buf)
+{
+    append(buf, "true");
+    for (int i = 0; i < 5000; i++) {
+        append(buf, i % 3 == 0 ? " && echo" : i % 3 == 1 ? " ; false || true" : " &&& sleep 0");
+    }
+}
+
+static void broken_line(struct buffer *buf)
+{
+    append(buf, "echo \"unterminated | ((cat ; ) > | < && || ;; &&& > > ( ) ) 'also");
+}
+
+static void empty_line(struct buffer *buf)
+{
+    append(buf, "");
+}
+
+static const struct {
+    const char *name;
+    void (*build)(struct buffer *buf);
+} corpus[] = {
+    {"empty", empty_line},
+    {"simple", simple_line},
+    {"realistic", realistic_line},
+    {"redirects", redirect_line},
+    {"quoted_64k", quoted_line},
+    {"deep_parens", deep_parens_line},
+    {"too_deep", too_deep_line},
+    {"pipes_5000", many_pipes_line},
+    {"list_5000", long_list_line},
+    {"broken", broken_line},
+};
+#define CORPUS_SIZE (sizeof(corpus) / sizeof(corpus[0]))
+
+//Parses line repeatedly for at least 0.2 s and prints the mean time per parse
+static void bench_line(const char *name, const char *line)
+{
+    long long start = monotonic_ns(), elapsed;
+    long runs = 0;
+    do {
+        for (int i = 0; i < 16; i++) {
+            parse_one(line);
+        }
+        runs += 16;
+        elapsed = monotonic_ns() - start;
+    } while (elapsed < 200000000LL);
+
+    printf("%-12s %9zu %10ld %14.1f %10.2f\n", name, strlen(line), runs, (double) elapsed / runs,
+           (double) elapsed / runs / (strlen(line) ? strlen(line) : 1));
+}
+
+static int write_corpus(const char *dir)
+{
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+        struct buffer buf = {0};
+        append(&buf, "");
+        corpus[i].build(&buf);
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, corpus[i].name);
+        FILE *file = fopen(path, "w");
+        if (!file) {
+            perror(path);
+            return 1;
+        }
+        fwrite(buf.text, 1, buf.length, file);
+        fclose(file);
+        free(buf.text);
+    }
+    return 0;
+}
+
+//Parses the whole file as one line
+static int parse_file(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(path);
+        return 1;
+    }
+    char *data = malloc(st.st_size + 1);
+    ssize_t length = data ? read(fd, data, st.st_size) : -1;
+    close(fd);
+    if (length < 0) {
+        perror(path);
+        return 1;
+    }
+    parse_bytes(data, length);
+    free(data);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 3 && strcmp(argv[1], "-w") == 0) {
+        return write_corpus(argv[2]);
+    }
+    if (argc > 1) {
+        int status = 0;
+        for (int i = 1; i < argc; i++) {
+            status |= parse_file(argv[i]);
+        }
+        return status;
+    }
+
+    //Benchmark: syntax errors are part of the corpus, their messages are not interesting
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDERR_FILENO);
+
+    printf("%-12s %9s %10s %14s %10s\n", "line", "bytes", "runs", "ns/line", "ns/byte");
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+        struct buffer buf = {0};
+        append(&buf, "");
+        corpus[i].build(&buf);
+        bench_line(corpus[i].name, buf.text);
+        free(buf.text);
+    }
+    return 0;
+}
+
+#endif
@@ -1,940 +1,4731 @@
-#include <ctype.h>
 #include "s3.h"
+#include <ctype.h>
 
 //This file contains the functions that are used in the shell. 
 
 
-//Helper function to do trimming
-char* trim(char *str){
-    if (!str){
-        return str;
-    }
-
-    //Move pointer forward if it is just a space
-     while (*str == ' '){
-        str++;
-    }
-
-    char *end = str + strlen(str);
-        while (end > str && *(end - 1) == ' ') {
-            end--;
-        }
-    *end = '\0'; // Null-terminate at the trimmed position
-    
-    return str;
-}
-
-
-///Simple for now, but will be expanded in a following section
-void construct_shell_prompt(char shell_prompt[], char lwd[])
+///Builds "[cwd s3]$ " for any length of cwd
+///Returns a malloc'd string, the caller frees it
+char *construct_shell_prompt(char lwd[])
 {
-    char cwd[MAX_PROMPT_LEN];
+    char *cwd = getcwd(NULL, 0); //getcwd allocates a buffer of the right size
+    char *shell_prompt;
 
-    if (getcwd(cwd, sizeof(cwd)) != NULL){
-        strcpy(shell_prompt, "[");
-        strcat(shell_prompt, cwd);
-        strcat(shell_prompt, " s3]$ ");
+    if (cwd != NULL){
+        shell_prompt = malloc(strlen(cwd) + sizeof("[ s3]$ "));
+        if (shell_prompt) {
+            sprintf(shell_prompt, "[%s s3]$ ", cwd);
+        }
+        free(cwd);
     } else{
-        strcpy(shell_prompt, "[s3]$ ");
+        shell_prompt = strdup("[s3]$ ");
     }
+    return shell_prompt;
 }
 
 ///Prints a shell prompt and reads input from the user
-void read_command_line(char line[], char lwd[])
+///line/line_cap = growable buffer, reused for every line (getline() enlarges it as needed)
+void read_command_line(char **line, size_t *line_cap, char lwd[])
 {
-    char shell_prompt[MAX_PROMPT_LEN];
-    construct_shell_prompt(shell_prompt, lwd);
-    printf("%s", shell_prompt);
+    char *shell_prompt = construct_shell_prompt(lwd);
+    printf("%s", shell_prompt ? shell_prompt : "[s3]$ ");
+    free(shell_prompt);
+    fflush(stdout);
 
-    ///See man page of fgets(...)
-    if (fgets(line, MAX_LINE, stdin) == NULL)
+    ///See man page of getline(...)
+    ssize_t len = getline(line, line_cap, stdin);
+    if (len == -1)
     {
-        perror("fgets failed");
+        if (feof(stdin)) { //Ctrl-D
+            printf("\n");
+            exit(0);
+        }
+        perror("getline failed");
         exit(1);
     }
     ///Remove newline (enter)
-    line[strlen(line) - 1] = '\0';
-}
-
-void parse_command(char line[], char *args[], int *argsc)
-{
-    ///Implements simple tokenization (space delimited)
-    ///Note: strtok puts '\0' (null) characters within the existing storage, 
-    ///to split it into logical cstrings.
-    ///There is no dynamic allocation.
-
-    ///See the man page of strtok(...)
-    char *token = strtok(line, " ");
-    *argsc = 0;
-    while (token != NULL && *argsc < MAX_ARGS - 1)
-    {
-        //add tokenised command to args while incrementing argsc
-        args[(*argsc)++] = token;
-        //find next string seperated by " "
-        token = strtok(NULL, " ");
-
-        if (token == NULL){
-            break;
-        }
-        // Now before we add the token to the new line, we must remove surrounding quotes from the token
-        // This accounts for edge cases like echo "Hi" where it would output "Hi" instead of Hi  
-
-        size_t len = strlen(token);
-
-        //compare with 2 as quote removal requires at least two characters
-        if (len >= 2) {
-
-            //flag to check if it has double quotes on both lines
-            int has_double_quotes = (token[0] == '"' && token[len-1] == '"');
-
-            int has_single_quotes = (token[0] == '\'' && token[len-1] == '\'');
-
-            if (has_double_quotes || has_single_quotes){
-                //shift the token by 1 to the left
-                // null terminate the token
-                memmove(token, token + 1, len - 2);
-                token[len - 2] = '\0';
-            }
-        }
-        
+    if (len > 0 && (*line)[len - 1] == '\n') {
+        (*line)[len - 1] = '\0';
     }
-    
-    args[*argsc] = NULL; ///args must be null terminated
 }
 
 /**
- * child
- * 
- * Use execvp to load the binary of the command specified in args[ARG_PROGNAME].
+ * read_script_line
  * 
- * Reference: Lecture 3
+ * Reads the next line of a script (or piped stdin) with no prompt at all: no getcwd(),
+ * no prompt string, no write to stdout. The caller gives input a large stdio buffer
+ * (see SCRIPT_BUFFER_SIZE), so long generated scripts are read in big chunks.
  * 
- * args = array of strings. args contains the command and its arguments
- * argsc = number of strings in args
+ * input = script file or stdin
+ * line/line_cap = growable buffer, reused for every line (getline() doubles it when a
+ *                 longer line comes along, so there is no length limit)
  * 
- * We do not need to worry about empty args because it is taken care of at launch_program
+ * Returns 1 if a line was read (newline removed), 0 at end of input.
  */
-void child(char *args[], int argsc)
+int read_script_line(FILE *input, char **line, size_t *line_cap)
 {
-    //transforms the current process into a new program
-    execvp(args[ARG_PROGNAME], args);
-
-    //if execvp is successful, we will not get here so we can do error handling here
-    fprintf(stderr, "Incorrect args\n");
-    exit(1);
-
-
+    ssize_t len = getline(line, line_cap, input);
+    if (len == -1) {
+        return 0;
+    }
+    if (len > 0 && (*line)[len - 1] == '\n') {
+        (*line)[len - 1] = '\0';
+    }
+    return 1;
 }
 
 /**
- * is_cd
+ * Per-line arena
  * 
- * checks if command is a cd command
- * returns 1 if true, 0 otherwise
+ * Every node of the command tree, and every word in it, is carved out of one arena.
+ * Nothing in the tree is freed on its own: once the line has run, arena_reset() drops it
+ * all at once. The first block is kept for the next line, so a typical line does no malloc.
  */
-int is_cd(const char *line) {
-    //input to is_cd is a null pointer, return 0
-    if (!line){
-        return 0;
+struct arena_block {
+    struct arena_block *next; //older (full) block
+    size_t used; //bytes handed out from data
+    size_t size; //capacity of data
+    char data[];
+};
+
+//Hands out size bytes from the arena (aligned for any type)
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    size_t align = sizeof(long double);
+    size = (size + align - 1) & ~(align - 1);
+
+    struct arena_block *block = arena->head;
+    if (block == NULL || block->size - block->used < size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(struct arena_block) + block_size);
+        if (!block) {
+            perror("malloc failed");
+            exit(1);
+        }
+        block->next = arena->head;
+        block->used = 0;
+        block->size = block_size;
+        arena->head = block;
     }
 
-    //if character in line exists ('\0' will output false) & character in line is space
-    //move pointer to next character
-    while (*line && isspace((unsigned char) *line)) { //Essentially scrolls through white spcae
-        line++;
+    void *ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+//Frees everything allocated from the arena. Keeps the newest block for reuse.
+void arena_reset(struct arena *arena)
+{
+    struct arena_block *block = arena->head;
+    if (!block) {
+        return;
     }
-    
-    //line[0] is a valid check as line[0] = '\0' for edge case of just spaces
-    if (line[0] == 'c' && line[1] == 'd' &&
-        (line[2] == '\0' || isspace((unsigned char)line[2]))) { //prevents lines like cdfoo
-        return 1;
+    struct arena_block *old = block->next;
+    while (old) { //only lines that overflowed one block get here
+        struct arena_block *next = old->next;
+        free(old);
+        old = next;
     }
-    return 0;
+    block->next = NULL;
+    block->used = 0;
 }
 
 /**
- * init_lwd
+ * Lexer
  * 
- * initialises a buffer to store previous directory
- * sets lwd[0] to '\0' which signals that there is no previous directory at init
+ * Splits the line into words and operators in a single left-to-right pass.
+ * Words are copied into the arena with their quotes removed, so "Hello World" and
+ * 'a|b' are single words and the operators inside them are plain text.
+ * $? outside single quotes is copied as STATUS_SLOT: three placeholder bytes that
+ * expand_status() later overwrites, in place, with the exit status (at most 3 digits).
  */
-void init_lwd(char lwd[]){
-    char cwd[MAX_PROMPT_LEN];
+#define STATUS_MARK '\x01'
+#define STATUS_SLOT "\x01\x01\x01"
+enum TokenType {
+    TOK_WORD,
+    TOK_PIPE, // |
+    TOK_OR, // ||
+    TOK_AND, // &&
+    TOK_SEMI, // ;
+    TOK_AMP, // &
+    TOK_PARALLEL, // &&&
+    TOK_LPAREN, // (
+    TOK_RPAREN, // )
+    TOK_IN, // <
+    TOK_OUT, // >
+    TOK_APPEND, // >>
+    TOK_END, // end of line
+    TOK_ERROR, // bad input, error already printed
+};
 
-    size_t max_available_size = MAX_PROMPT_LEN - 6;
+struct lexer {
+    const char *pos; //next character to read
+    const char *token_start; //where the current token begins in the line
+    struct arena *arena; //where words are copied to
+    enum TokenType token; //current token (one token lookahead)
+    char *word; //text of the current token if it is TOK_WORD
+    int word_has_status; //the current word holds a $? slot
+    int depth; //subshells open at the current token
+};
 
-    if (getcwd(cwd, sizeof(cwd)) != NULL){
-        if(strlen(cwd) >= max_available_size){
-            lwd[0] = '\0';
-        } else {
-            //copies until we find '\0' and copies '\0' too
-            strcpy(lwd, cwd);
-        }
-    } else{
-        lwd[0] = '\0'; //no prev directory
-    }
+//Characters that end a word (outside of quotes)
+static int is_word_char(char ch)
+{
+    return ch != '\0' && !isspace((unsigned char) ch) && strchr("|;&()<>", ch) == NULL;
 }
 
-/**
- * run_cd
- * 
- * Uses chdir() to change present working directory of the process
- *  
- * args = array of strings. args contains the command and its arguments
- * argsc = number of strings in args
- * lwd[] = array to store previous working directory
- * 
- * Edge case to handle: 
- *  1) cd -: goes to previous directory
- *  2) cd ..: goes to the directory above the current directory
- *  3) cd : goes to home directory
- *  4) cd a b: sends error (too many arguments)
- *  5) cd non/existent/path/ : sends error (invalid file)
- */
-int run_cd(char *args[], int argsc, char lwd[]) {
-    if (argsc > 2){ //too many arguments, throw cd error
-        fprintf(stderr, "cd error, too many arguments\n");
-        return -1;
+//Moves the lexer on to the next token
+static void lexer_next(struct lexer *lex)
+{
+    while (isspace((unsigned char) *lex->pos)) {
+        lex->pos++;
     }
-    
-    const char *path = NULL;
-    
-    if (argsc > 1 && args[1]){
-        if (strcmp(args[1], "-") == 0) { //if cd path is "-", go to previous directory
-            if (!lwd || lwd[0] == '\0') { //lwd does not exist
-                fprintf(stderr, "cd, no prev directory\n");
-                return -1;
-            }
-            path = lwd;
-        } else { //else go to specified path
-            path = args[1];
-        }
-    } else { //if cd path is blank, go to home file directory
-        path = getenv("HOME");
+
+    //'#' at the start of a word comments out the rest of the line (e.g. a script's #! line)
+    if (*lex->pos == '#') {
+        lex->pos += strlen(lex->pos);
     }
 
-    //path validation
-    if (!path || path[0] == '\0') {
-        fprintf(stderr, "cd error, path not set\n");
-        return -1;
+    lex->word = NULL;
+    lex->token_start = lex->pos;
+    switch (*lex->pos) {
+    case '\0': lex->token = TOK_END; return;
+    case '|':
+        if (lex->pos[1] == '|') {
+            lex->token = TOK_OR;
+            lex->pos += 2;
+        } else {
+            lex->token = TOK_PIPE;
+            lex->pos++;
+        }
+        return;
+    case ';': lex->token = TOK_SEMI; lex->pos++; return;
+    case '&':
+        if (strncmp(lex->pos, "&&&", 3) == 0) {
+            lex->token = TOK_PARALLEL;
+            lex->pos += 3;
+        } else if (lex->pos[1] == '&') {
+            lex->token = TOK_AND;
+            lex->pos += 2;
+        } else {
+            lex->token = TOK_AMP;
+            lex->pos++;
+        }
+        return;
+    case '(': lex->token = TOK_LPAREN; lex->pos++; return;
+    case ')': lex->token = TOK_RPAREN; lex->pos++; return;
+    case '<': lex->token = TOK_IN; lex->pos++; return;
+    case '>':
+        if (lex->pos[1] == '>') {
+            lex->token = TOK_APPEND;
+            lex->pos += 2;
+        } else {
+            lex->token = TOK_OUT;
+            lex->pos++;
+        }
+        return;
     }
 
-    char *oldpwd = getcwd(NULL, 0);
+    //Word: first find where it ends and how long it is without quotes, then copy it
+    const char *end = lex->pos;
+    size_t len = 0;
+    while (is_word_char(*end)) {
+        if (*end == '"' || *end == '\'') {
+            const char *close = strchr(end + 1, *end);
+            if (!close) {
+                fprintf(stderr, "Unterminated quote\n");
+                lex->token = TOK_ERROR;
+                return;
+            }
+            len += close - end - 1;
+            end = close + 1;
+        } else {
+            len++;
+            end++;
+        }
+    }
 
-    //Change directory to path with chdir
-    if (chdir(path) != 0) { //chdir returns -1 on failure
-        fprintf(stderr, "chdir error\n");
-        free(oldpwd);
-        return -1;
+    for (const char *ch = lex->pos; ch < end; ch++) {
+        if (*ch == '$') {
+            len++; //room for a $? slot (3 bytes for 2 characters)
+        }
     }
 
-    //set new lwd with oldpwd
-    //to manage working directories to allow for "cd -"
-    if (oldpwd){
-        size_t max_available_size = MAX_PROMPT_LEN - 6;
-        if(strlen(oldpwd) >= max_available_size){
-            lwd[0] = '\0';
+    char *word = arena_alloc(lex->arena, len + 1);
+    char *out = word;
+    const char *in = lex->pos;
+    char quote = '\0'; //quote we are inside of, if any
+    lex->word_has_status = 0;
+    while (in < end) {
+        if (quote == '\0' && (*in == '"' || *in == '\'')) {
+            quote = *in++;
+        } else if (quote != '\0' && *in == quote) {
+            quote = '\0';
+            in++;
+        } else if (quote != '\'' && in[0] == '$' && in[1] == '?') {
+            memcpy(out, STATUS_SLOT, 3);
+            out += 3;
+            in += 2;
+            lex->word_has_status = 1;
         } else {
-            //copies until we find '\0' and copies '\0' too
-            strcpy(lwd, oldpwd);
+            *out++ = *in++;
         }
-    } else {
-        lwd[0] = '\0';
     }
+    *out = '\0';
 
-    free(oldpwd);
-    return 0;
+    lex->pos = end;
+    lex->word = word;
+    lex->token = TOK_WORD;
 }
 
+static int is_redirection_token(enum TokenType token)
+{
+    return token == TOK_IN || token == TOK_OUT || token == TOK_APPEND;
+}
+
+//Prints a syntax error for the current token (unless the lexer already reported one)
+static void syntax_error(struct lexer *lex)
+{
+    static const char *names[] = {
+        [TOK_PIPE] = "|", [TOK_OR] = "||", [TOK_AND] = "&&", [TOK_SEMI] = ";", [TOK_AMP] = "&",
+        [TOK_PARALLEL] = "&&&", [TOK_LPAREN] = "(", [TOK_RPAREN] = ")",
+        [TOK_IN] = "<", [TOK_OUT] = ">", [TOK_APPEND] = ">>", [TOK_END] = "newline",
+    };
+
+    if (lex->token == TOK_ERROR) {
+        return;
+    }
+    fprintf(stderr, "Syntax error near '%s'\n", lex->token == TOK_WORD ? lex->word : names[lex->token]);
+}
 
 /**
- * launch_program
+ * Parser
  * 
- * fork() a child process.
- * In the child part of the code, call child(args, argv)
- *
- * Reference: Lecture 2 
- *  
- * args = array of strings. args contains the command and its arguments
- * argsc = number of strings in args
+ * Recursive descent over the token stream, building the command tree as it goes:
  * 
- * Edge case to handle: 
- *  1) Empty args **MUST BE CONSIDERED**
- *  2) "exit" command: shell (not the child) should exit
- *
+ *   list      := and_or ( ( ';' | '&' | '&&&' ) and_or )* [ ';' | '&' | '&&&' ]
+ *   and_or    := pipeline ( ( '&&' | '||' ) pipeline )*
+ *   pipeline  := stage ( '|' stage )*
+ *   stage     := '(' list ')' redirection*  |  ( word | redirection )+
+ *   redirection := ( '<' | '>' | '>>' ) word
+ * 
+ * An and_or stays flat in the list: each entry records the operator written after it.
+ * Each parse_* function returns NULL after printing an error.
  */
-void launch_program(char *args[], int argsc)
+static struct command_node *parse_list(struct lexer *lex);
+
+static struct command_node *new_node(struct arena *arena, enum NodeType type)
 {
+    struct command_node *node = arena_alloc(arena, sizeof(struct command_node));
+    memset(node, 0, sizeof(struct command_node));
+    node->type = type;
+    return node;
+}
 
-    if (args[0] != NULL && strcmp(args[0], "exit") == 0){
-        exit(0); //success status code
+//Parses one redirection operator and its file, appending it at *tail
+static int parse_redirection(struct lexer *lex, struct command_node *node, struct redirection ***tail)
+{
+    enum RedirType type = REDIR_IN;
+    if (lex->token == TOK_OUT) {
+        type = REDIR_OUT;
+    } else if (lex->token == TOK_APPEND) {
+        type = REDIR_APPEND;
     }
-    int pid = fork();
-    if (pid < 0) { //fork failed, exit
-        fprintf(stderr, "fork failed\n");
-        exit(1); // error status code
-    } else if (pid==0) { //child process, run child
-        child(args, argsc);
-    } else { //parent node
-        //Do nothing, wait for reap() to handle the waiting   
+
+    lexer_next(lex);
+    if (lex->token != TOK_WORD) {
+        if (lex->token != TOK_ERROR) {
+            fprintf(stderr, "Redirection syntax error\n");
+        }
+        return 0;
     }
+
+    struct redirection *redir = arena_alloc(lex->arena, sizeof(struct redirection));
+    redir->type = type;
+    redir->file = lex->word;
+    redir->next = NULL;
+    **tail = redir;
+    *tail = &redir->next;
+    node->has_status |= lex->word_has_status;
+
+    lexer_next(lex);
+    return 1;
 }
 
-int command_with_redirection(char line[])
+//Appends word to a growable argv that lives in the arena. The capacity doubles when full,
+//so a command with n words costs O(n) copying in total and no malloc at all.
+static void push_word(struct arena *arena, struct command_node *cmd, int *capacity, char *word)
 {
-    for (size_t i = 0; line[i] != '\0'; i++) {
-        if (line[i] == '>' ||  line[i] == '<')  //We only want to parse the detailed redirection info when the operators appear, we return 1 for the main loop if we find redirection
-            return 1;
+    if (cmd->count + 1 >= *capacity) { //+1 keeps room for the NULL terminator
+        int new_capacity = *capacity ? *capacity * 2 : 8;
+        char **grown = arena_alloc(arena, new_capacity * sizeof(char *));
+        if (cmd->count > 0) {
+            memcpy(grown, cmd->argv, cmd->count * sizeof(char *));
+        }
+        cmd->argv = grown;
+        *capacity = new_capacity;
     }
-    return 0;
+    cmd->argv[cmd->count++] = word;
+    cmd->argv[cmd->count] = NULL; ///args must be null terminated
 }
 
-//Use this helper function to check if the command contains a pipe (used in the main loop)
-int command_with_pipes(char line[])
+//Parses a simple command: words and redirections in any order
+static struct command_node *parse_simple_command(struct lexer *lex)
 {
-    for (size_t i = 0; line[i] != '\0'; i++) {
-        if (line[i] == '|')
-            return 1;
+    struct command_node *cmd = new_node(lex->arena, NODE_COMMAND);
+    struct redirection **redir_tail = &cmd->redirs;
+    int capacity = 0;
+
+    while (1) {
+        if (lex->token == TOK_WORD) {
+            cmd->has_status |= lex->word_has_status;
+            push_word(lex->arena, cmd, &capacity, lex->word);
+            lexer_next(lex);
+        } else if (is_redirection_token(lex->token)) {
+            if (!parse_redirection(lex, cmd, &redir_tail)) {
+                return NULL;
+            }
+        } else {
+            break;
+        }
     }
-    return 0;
+
+    if (cmd->count == 0) { //e.g. "> file" with no command
+        fprintf(stderr, "Redirection syntax error\n");
+        return NULL;
+    }
+    return cmd;
 }
 
-// This function checks if the command contains a semicolon (.i.e if it is a batched command)
-int command_with_batch(char line[])
+//Parses '(' list ')' followed by optional redirections
+static struct command_node *parse_subshell(struct lexer *lex)
 {
-    for (size_t i = 0; line[i] != '\0'; i++) {
-        if (line[i] == ';') {
-            return 1;
+    lexer_next(lex); //skip '('
+
+    //Each level is a C stack frame per grammar rule, so input like 100000 '(' must stop here
+    if (++lex->depth > MAX_SUBSHELL_DEPTH) {
+        fprintf(stderr, "Subshells nested too deeply\n");
+        lex->token = TOK_ERROR; //already reported
+        return NULL;
+    }
+    struct command_node *body = parse_list(lex);
+    lex->depth--;
+    if (!body) {
+        return NULL;
+    }
+    if (lex->token != TOK_RPAREN) {
+        if (lex->token != TOK_ERROR) {
+            fprintf(stderr, "Unbalanced parentheses\n");
         }
+        return NULL;
     }
-    return 0;
-}
+    lexer_next(lex); //skip ')'
 
-//Detects if the command line contains parentheses (i.e if it is a subshell command)
-int command_with_subshell(char line[])
-{
-    for (size_t i = 0; line[i] != '\0'; i++) { // If we find a '(' or ')', return 1, as it contains a subshell command
-        if (line[i] == '(' || line[i] == ')')
-            return 1;
+    if (body->count == 0) {
+        fprintf(stderr, "Subshell command syntax error\n");
+        return NULL;
     }
-    return 0; // Doesn't contain a subshell command
-}
 
-//This returns the index of the operator if found, -1 otherwise.
-//It sets the file, appends, input depends on the operator type.
-//The key idea of this function is to record the file to use, whether it's append mode, and whether it's input redirection.
-int find_redirection(char *tokens[], int count, char **file, int *append, int *input)
-{
-    for (int i = 0; i < count; i++) {
-        if (strcmp(tokens[i], ">") == 0) { //String compare
-            *file = tokens[i + 1];
-            *append = 0;
-            *input = 0;
-            return i;
-        } else if (strcmp(tokens[i], ">>") == 0) {
-            *file = tokens[i + 1];
-            *append = 1;
-            *input = 0;
-            return i;
-        } else if (strcmp(tokens[i], "<") == 0) {
-            *file = tokens[i + 1];
-            *append = 0;
-            *input = 1;
-            return i;
+    // ((((cmd)))) -> (cmd), so N levels of parentheses cost one child process.
+    // A subshell whose body is nothing but another subshell has no observable effect:
+    // the outer child is already isolated and does nothing else. Unless the inner one has
+    // redirections or its pipeline has a prefix (time, cache, pipesize=), which would be lost.
+    struct command_node *inner = body->children;
+    struct command_node *only = inner->children;
+    if (body->count == 1 && inner->count == 1 && inner->op == OP_SEQUENCE
+        && !inner->timed && !inner->cached && inner->pipe_size == 0
+        && only->type == NODE_SUBSHELL && only->redirs == NULL) {
+        body = only->children;
+    }
+
+    struct command_node *subshell = new_node(lex->arena, NODE_SUBSHELL);
+    subshell->children = body;
+    struct redirection **redir_tail = &subshell->redirs;
+    while (is_redirection_token(lex->token)) {
+        if (!parse_redirection(lex, subshell, &redir_tail)) {
+            return NULL;
         }
     }
-    return -1;
+    return subshell;
 }
 
+static struct command_node *parse_stage(struct lexer *lex)
+{
+    if (lex->token == TOK_LPAREN) {
+        return parse_subshell(lex);
+    }
+    if (lex->token == TOK_WORD || is_redirection_token(lex->token)) {
+        return parse_simple_command(lex);
+    }
+    syntax_error(lex);
+    return NULL;
+}
 
 /**
- * tokenize_pipeline
+ * Pipeline rewrites
  * 
- * Splits the raw line into individual commands separated by '|'
- * Ignores all '|' inside parentheses
- * If we find a pipeline character, append the command before the pipeline character to commands and increment command_count
+ * Applied to every pipeline as it is parsed (unless "set rewrite=0"), replacing stages
+ * with cheaper ones that give the same output:
  * 
- * Returns 1 if successful, and 0 if we have a parse failure
- * 
- * Input:
- * line[] =  input string
- * Output:
- * *commands[] = An array of pointers, each pointing to the start of each command in line[]
- * *command_count = number of commands
+ *   cat file | cmd ...        ->  cmd < file ...    one process and one pipe copy less
+ *   ... | sort [files] | uniq ...  ->  ... | sort -u [files] ...
  * 
+ * Only the forms that are provably equivalent are touched: cat with exactly one file and
+ * no options, sort without options (-n, -f... change what "equal" means), uniq without
+ * options, and no redirections that would make the pipe unused. The file cat would have
+ * read becomes a REDIR_CAT redirection, which reports an unreadable file the way cat does
+ * and then reads as empty, so even a missing file behaves as before.
+ * With "set plan=1" each rewritten pipeline is shown on stderr as "rewrite: old => new".
  */
-int tokenize_pipeline(char line[], char *commands[], int *command_count) 
+
+//1 if cmd is a simple command named name with no $? to fill in
+static int is_command(struct command_node *cmd, const char *name)
+{
+    return cmd->type == NODE_COMMAND && !cmd->has_status && strcmp(cmd->argv[ARG_PROGNAME], name) == 0;
+}
+
+//1 if redirs holds a redirection in the given direction
+static int has_redirection(struct redirection *redirs, int input)
 {
-    *command_count = 0;
+    for (; redirs != NULL; redirs = redirs->next) {
+        if ((redirs->type == REDIR_IN || redirs->type == REDIR_CAT) == input) {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    int paren_depth = 0;
+//"cat file | next" -> "next < file". Returns 1 if stage (the first stage) was removed.
+static int rewrite_cat(struct arena *arena, struct command_node *pipeline)
+{
+    struct command_node *cat = pipeline->children;
+    struct command_node *next = cat->next;
+    if (!is_command(cat, "cat") || cat->count != 2 || cat->argv[ARG_1][0] == '-'
+        || cat->redirs != NULL || has_redirection(next->redirs, 1)) {
+        return 0;
+    }
 
-    char *begin = line;
-    size_t len = strlen(line);
+    struct redirection *input = arena_alloc(arena, sizeof(struct redirection));
+    input->type = REDIR_CAT;
+    input->file = cat->argv[ARG_1];
+    input->next = next->redirs;
+    next->redirs = input;
 
-    for (size_t index = 0; index<= len; index++) {
-        char ch = line[index];
+    pipeline->children = next;
+    pipeline->count--;
+    return 1;
+}
 
-        if (ch == '('){
-            paren_depth++;
-        } else if (ch == ')' && paren_depth > 0){
-            paren_depth--;
-        } else if (ch == ')' && paren_depth == 0){
-            fprintf(stderr, "Unbalanced parentheses");
+//"sort [files] | uniq" -> "sort -u [files]". Returns 1 if the uniq after sort was merged in.
+static int rewrite_sort_uniq(struct arena *arena, struct command_node *sort)
+{
+    struct command_node *uniq = sort->next;
+    if (!is_command(sort, "sort") || !is_command(uniq, "uniq") || uniq->count != 1
+        || has_redirection(sort->redirs, 0) || has_redirection(uniq->redirs, 1)) {
+        return 0;
+    }
+    for (int i = 1; i < sort->count; i++) {
+        if (sort->argv[i][0] == '-') {
             return 0;
         }
+    }
 
-        if ((ch == '|' && paren_depth == 0) || ch == '\0') {
-            line[index] = '\0';
+    char **argv = arena_alloc(arena, (sort->count + 2) * sizeof(char *));
+    argv[0] = sort->argv[ARG_PROGNAME];
+    argv[1] = "-u";
+    memcpy(argv + 2, sort->argv + 1, sort->count * sizeof(char *)); //args and the NULL
+    sort->argv = argv;
+    sort->count++;
+
+    //uniq's output redirections now belong to sort
+    struct redirection **tail = &sort->redirs;
+    while (*tail != NULL) {
+        tail = &(*tail)->next;
+    }
+    *tail = uniq->redirs;
 
-            char *token = begin;
+    sort->next = uniq->next;
+    return 1;
+}
 
-            trim(token);
+//Writes a command tree node back out as shell text, for "set plan=1"
+static void print_node(FILE *out, struct command_node *node)
+{
+    static const char *ops[] = {
+        [OP_SEQUENCE] = " ;", [OP_BACKGROUND] = " &", [OP_PARALLEL] = " &&&",
+        [OP_AND] = " &&", [OP_OR] = " ||",
+    };
+    static const char *redirs[] = {
+        [REDIR_IN] = "<", [REDIR_OUT] = ">", [REDIR_APPEND] = ">>", [REDIR_CAT] = "<",
+    };
 
-            // Add command if not empty
-            if (*token == '\0') {
-                if (ch == '\0'){
-                    // Result of using '\0' as null seperator
-                    // is that it will also look at the end of line null terminator.
-                    // As a result, we just ignore it with break
-                    break;
-                } else {
-                    fprintf(stderr, "Empty command in pipeline\n");
-                    return 0;
-                }
-            } else { //Check if token is not empty. If not empty, and we did not exceed max args, append to commands
-                if (*command_count >= MAX_ARGS-1){
-                    fprintf(stderr, "Too many pipeline commands\n");
-                    return 0;
-                }
-                commands[(*command_count)++] = token;
+    if (node->type == NODE_LIST || node->type == NODE_PIPELINE) {
+        for (struct command_node *child = node->children; child != NULL; child = child->next) {
+            print_node(out, child);
+            if (child->next != NULL) {
+                fputs(node->type == NODE_LIST ? ops[child->op] : " |", out);
+                fputc(' ', out);
             }
-            begin = line + index + 1;
         }
+        return;
     }
 
-    if (paren_depth != 0){
-        fprintf(stderr, "Unbalanced parentheses");
-        return 0;
+    if (node->type == NODE_SUBSHELL) {
+        fputc('(', out);
+        print_node(out, node->children);
+        fputc(')', out);
+    } else {
+        for (int i = 0; i < node->count; i++) {
+            fprintf(out, i > 0 ? " %s" : "%s", node->argv[i]);
+        }
+    }
+    for (struct redirection *redir = node->redirs; redir != NULL; redir = redir->next) {
+        fprintf(out, " %s %s", redirs[redir->type], redir->file);
     }
-
-    //null terminate command
-    commands[*command_count] = NULL;
-
-    return *command_count > 0;
 }
 
 /**
- * tokenize_batched_commands
- * 
- * Splits the raw line into individual commands separated by semicolons
- * Ignores all ';' inside parentheses
- * If we find a batched character, append the command before the batched character to commands and increment command_count
+ * rewrite_pipeline
  * 
- * ALMOST THE SAME AS TOKENIZE_PIPELINE_COMMANDS except for the chracter we are looking for - quite obviously.
+ * Applies the pipeline rewrites to a freshly parsed pipeline.
  * 
- * Returns 1 if successful, and 0 if we have a parse failure
- * 
- * Input:
- * line[] =  input string
- * Output:
- * *commands[] = An array of pointers, each pointing to the start of each command in line[]
- * *command_count = number of commands
+ * text, len = the pipeline as written, shown by "set plan=1"
  */
-int tokenize_batched_commands(char line[], char *commands[], int * command_count)
+static void rewrite_pipeline(struct arena *arena, struct command_node *pipeline, const char *text, size_t len)
 {
-    *command_count = 0;
+    if (pipeline->count < 2 || !get_option(OPT_REWRITE)) {
+        return;
+    }
 
-    int paren_depth = 0;
+    int rewritten = rewrite_cat(arena, pipeline);
+    struct command_node *stage = pipeline->children;
+    while (stage->next != NULL) {
+        if (rewrite_sort_uniq(arena, stage)) {
+            pipeline->count--;
+            rewritten = 1;
+        } else {
+            stage = stage->next;
+        }
+    }
 
-    char *begin = line; //beginnning of current command
-    size_t len = strlen(line);
+    if (rewritten && get_option(OPT_PLAN)) {
+        while (len > 0 && isspace((unsigned char) text[len - 1])) {
+            len--;
+        }
+        fprintf(stderr, "rewrite: %.*s => ", (int) len, text);
+        print_node(stderr, pipeline);
+        fputc('\n', stderr);
+    }
+}
 
-    for (size_t index = 0; index<= len; index++) {
-        char ch = line[index];
+static struct command_node *parse_pipeline(struct lexer *lex)
+{
+    struct command_node *pipeline = new_node(lex->arena, NODE_PIPELINE);
+    struct command_node **tail = &pipeline->children;
+    const char *start = lex->token_start;
 
-        if (ch == '('){
-            paren_depth++;
-        } else if (ch == ')'){
-            if (paren_depth == 0){
-                fprintf(stderr, "Unmatched closing parentheses\n");
-                return 0;
+    //Prefixes, in any order:
+    //  "time a | b": report the resource usage of each stage when it is done
+    //  "pipesize=1M a | b": pipe buffer size for this pipeline only
+    //  "cache a | b": replay the stored results while the inputs are unchanged
+    while (lex->token == TOK_WORD) {
+        if (strcmp(lex->word, "time") == 0) {
+            pipeline->timed = 1;
+        } else if (strcmp(lex->word, "cache") == 0) {
+            pipeline->cached = 1;
+        } else if (strncmp(lex->word, "pipesize=", 9) == 0) {
+            if (!parse_option_value(lex->word + 9, &pipeline->pipe_size)) {
+                fprintf(stderr, "Invalid pipe size '%s'\n", lex->word + 9);
+                return NULL;
             }
-            paren_depth--;
+        } else {
+            break;
         }
+        lexer_next(lex);
+        start = lex->token_start;
+    }
 
-        if ((ch == ';' && paren_depth == 0) || ch == '\0') {
-            line[index] = '\0';
+    while (1) {
+        struct command_node *stage = parse_stage(lex);
+        if (!stage) {
+            return NULL;
+        }
+        *tail = stage;
+        tail = &stage->next;
+        pipeline->count++;
 
-            char *token = begin;
-            
-            //trim token
-            trim(token);
+        if (lex->token != TOK_PIPE) {
+            rewrite_pipeline(lex->arena, pipeline, start, lex->token_start - start);
+            return pipeline;
+        }
+        lexer_next(lex);
 
-            // Add command if not empty
-            if (*token != '\0') {
-                if (*command_count >= MAX_ARGS-1){
-                    fprintf(stderr, "Too many batched commands");
-                    return 0;
-                }
-                commands[(*command_count)++] = token;
-            }
-            begin = line + index + 1; //start token on next character after the inputted token
+        if (lex->token == TOK_END || lex->token == TOK_PIPE || lex->token == TOK_SEMI
+            || lex->token == TOK_RPAREN) {
+            fprintf(stderr, "Empty command in pipeline\n");
+            return NULL;
         }
     }
-    if (paren_depth != 0){ //edgecase, unbalanced parantehses
-        fprintf(stderr, "Unbalanced parentheses");
-        return 0;
-    }
-    
-    //null terminate command <- not my code again
-    commands[*command_count] = NULL;
-
-    return *command_count > 0;
 }
 
-/**
- * extract_subshell_commands
- * 
- * Divides line by subshell commands. Appends to *subshell_cmd
- * 
- * Doesn't need to account for batched commands as it is already accounted for in s3main.c
- * 
- * Returns 1 if successful, and 0 if we have a failure
- * 
- * Input:
- * line[] =  input string
- * Output:
- * *subshell_command = pointer to start of command in the subshell
- * 
- * Edge case to handle: 
- *  1) Trailing + Leading spaces
- *  2) Incorrect parentheses depth (incorrect pairings of opening and closing parentheses)
- *  3) Null terminator in EOL
- */
-int extract_subshell_commands(char line[], char *subshell_command) 
+//Turns the && / || chain of count entries starting at first into one entry: a subshell
+//running the chain. Used when the chain as a whole goes to the background or a '&&&' group.
+static struct command_node *wrap_chain(struct arena *arena, struct command_node *first, int count)
 {
-    int paren_depth = 0; //tracks depth of parentheses. 0 is top-level
-    int top_open_paren = -1; //first index of open parentheses '('
-    int top_close_paren = -1; //index of top-level closing parentheses ')'
-
-    //find and input index for first opening and closing parentheses (top level)
-    for (size_t index = 0; line[index] != '\0'; index++) { //index to scroll through string
+    struct command_node *body = new_node(arena, NODE_LIST);
+    body->children = first;
+    body->count = count;
 
-        if (line[index] == '(') {
-            // If paren_depth is 0 (top-level): Set top_open_paren to the index. else, skip
-            // After checking for paren_depth, increment paren_depth by 1.
-            if (paren_depth == 0){
-                top_open_paren = index;
-            }
-            paren_depth++;
+    struct command_node *subshell = new_node(arena, NODE_SUBSHELL);
+    subshell->children = body;
 
-        } else if (line[index] == ')'){
-            // If paren_depth is 0 (top-level): Return 0 (error)
-            // Decrement paren_depth
-            // If paren_depth is now 0, Set top_close_paren to the index. else, skip
-            if (paren_depth == 0){
-                //unbalanced set of parentheses
-                return 0;
-            }
+    struct command_node *pipeline = new_node(arena, NODE_PIPELINE);
+    pipeline->children = subshell;
+    pipeline->count = 1;
+    return pipeline;
+}
 
-            paren_depth--;
+//Parses pipelines separated by ';' up to the end of the line or a ')'
+static struct command_node *parse_list(struct lexer *lex)
+{
+    struct command_node *list = new_node(lex->arena, NODE_LIST);
+    struct command_node **tail = &list->children;
+    struct command_node **chain_head = tail; //link to the first entry of the current && / || chain
+    const char *chain_start = NULL; //where that chain begins in the line
+    int chain_len = 0;
+    int in_group = 0; //the chain follows '&&&'
 
-            if (paren_depth == 0){
-                top_close_paren = index;
-                break;
+    while (1) {
+        if (chain_len == 0) {
+            //Empty commands like "cmd1 ;; cmd2" or a trailing ';' are skipped
+            while (lex->token == TOK_SEMI) {
+                lexer_next(lex);
             }
+            if (lex->token == TOK_END || lex->token == TOK_RPAREN) {
+                return list;
+            }
+            chain_head = tail;
+            chain_start = lex->token_start;
         }
-    }
 
-    //Make sure there are open/close paren pair, or we dont have something like )echo xx(
-    if (top_open_paren == -1 || top_close_paren == -1 || top_close_paren <= top_open_paren) {
-        return 0;
+        struct command_node *pipeline = parse_pipeline(lex);
+        if (!pipeline) {
+            return NULL;
+        }
+        *tail = pipeline;
+        tail = &pipeline->next;
+        list->count++;
+        chain_len++;
+
+        if (lex->token == TOK_AND || lex->token == TOK_OR) {
+            pipeline->op = lex->token == TOK_AND ? OP_AND : OP_OR;
+            lexer_next(lex); //a command must follow: "a &&" or "a && ;" is a syntax error
+            continue;
+        }
+
+        enum ListOp op = OP_SEQUENCE;
+        if (lex->token == TOK_AMP) {
+            op = OP_BACKGROUND;
+        } else if (lex->token == TOK_PARALLEL) {
+            op = OP_PARALLEL;
+        } else if (lex->token != TOK_SEMI && lex->token != TOK_END && lex->token != TOK_RPAREN) {
+            syntax_error(lex); //e.g. "echo (hi)"
+            return NULL;
+        }
+
+        //"a && b &" backgrounds the whole chain, and in "x &&& a && b" the whole chain is one
+        //entry of the group, as '&' and '&&&' bind looser than && and ||
+        if (chain_len > 1 && (op != OP_SEQUENCE || in_group)) {
+            pipeline = wrap_chain(lex->arena, *chain_head, chain_len);
+            *chain_head = pipeline;
+            tail = &pipeline->next;
+            list->count -= chain_len - 1;
+        }
+
+        if (op == OP_BACKGROUND) {
+            //Keep the source text for "jobs" and the "Done" message
+            size_t len = lex->token_start - chain_start;
+            while (len > 0 && isspace((unsigned char) chain_start[len - 1])) {
+                len--;
+            }
+            pipeline->text = arena_alloc(lex->arena, len + 1);
+            memcpy(pipeline->text, chain_start, len);
+            pipeline->text[len] = '\0';
+        }
+        pipeline->op = op;
+        in_group = op == OP_PARALLEL;
+        chain_len = 0;
+        if (op != OP_SEQUENCE) {
+            lexer_next(lex);
+        }
     }
+}
 
-    size_t len = top_close_paren - top_open_paren - 1; // -1 to account for the double counting of the parentheses
+/**
+ * parse_line
+ * 
+ * Lexes and parses a whole command line in one pass into a command tree
+ * (list -> pipelines -> stages), allocated from arena.
+ * The line itself is not modified.
+ * 
+ * Returns the NODE_LIST at the root (may have no children for a blank line),
+ * or NULL on a syntax error (already reported).
+ */
+struct command_node *parse_line(const char line[], struct arena *arena)
+{
+    long long start = monotonic_ns();
+    struct lexer lex;
+    lex.pos = line;
+    lex.arena = arena;
+    lex.depth = 0;
+    lexer_next(&lex);
 
-    //size bound may be neccessary
-    strncpy(subshell_command, line + top_open_paren + 1, len); // Copy the command string inside the parentheses
-    subshell_command[len] = '\0'; // Null-terminate the string
+    struct command_node *list = parse_list(&lex);
+    if (list && lex.token == TOK_RPAREN) {
+        fprintf(stderr, "Unbalanced parentheses\n");
+        list = NULL;
+    }
 
-    // Trim string
-    trim(subshell_command);
-    return strlen(subshell_command) > 0; // Returns 1 if successful, 0 if failure
+    long long elapsed = monotonic_ns() - start;
+    count_parse(elapsed);
+    if (tracing()) {
+        trace_begin("parse");
+        trace_int("dur_ns", elapsed);
+        trace_int("bytes", strlen(line));
+        trace_int("entries", list ? list->count : -1); //-1: syntax error
+        trace_end();
+    }
+    return list;
 }
 
+/**
+ * PATH lookup cache
+ * 
+ * execvp()/posix_spawnp() walk every $PATH directory and try to exec in each one, every
+ * single time a command runs. Instead we resolve a command name once, remember the absolute
+ * path in a small open-addressing hash table, and exec that path directly from then on.
+ * 
+ * The table is thrown away when $PATH changes, and a single entry is dropped when exec'ing
+ * it fails with ENOENT (the binary was moved or deleted).
+ */
+struct path_cache_entry {
+    char *name; //command name as typed, NULL if the slot is empty
+    char *path; //absolute path it resolved to
+    unsigned int hits; //number of times the entry was used (shown by "hash")
+};
 
+static struct path_cache_entry path_cache[PATH_CACHE_SIZE];
+static int path_cache_count = 0;
+static char *path_cache_path = NULL; //copy of $PATH the table was filled against
 
-//Child helper function for redirection - The child process needs to rewire its stdin/stdout before calling execvp.
-static void child_with_redirection(char *args[], int argsc, char *filename, int append, int input)
+//FNV-1a string hash
+static unsigned int hash_name(const char *name)
 {
-    int fd; //file descriptor
-    if (input) {
-        fd = open(filename, O_RDONLY);
-        if (fd == -1) {
-            perror("open failed");
-            exit(1);
-        }
-        if (dup2(fd, STDIN_FILENO) == -1) {
-            perror("dup2 failed");
-            close(fd);
-            exit(1);
-        }
-    } else {
-        int flags = O_WRONLY | O_CREAT;
-        flags |= append ? O_APPEND : O_TRUNC;
-        fd = open(filename, flags, 0644);
-        if (fd == -1) {
-            perror("open failed");
-            exit(1);
+    unsigned int h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+//Returns the slot holding name, or the empty slot where it would go (linear probing)
+static struct path_cache_entry *path_cache_slot(const char *name)
+{
+    unsigned int i = hash_name(name) & (PATH_CACHE_SIZE - 1);
+    while (path_cache[i].name != NULL && strcmp(path_cache[i].name, name) != 0) {
+        i = (i + 1) & (PATH_CACHE_SIZE - 1);
+    }
+    return &path_cache[i];
+}
+
+void clear_path_cache(void)
+{
+    for (int i = 0; i < PATH_CACHE_SIZE; i++) {
+        free(path_cache[i].name);
+        free(path_cache[i].path);
+        path_cache[i].name = NULL;
+        path_cache[i].path = NULL;
+        path_cache[i].hits = 0;
+    }
+    path_cache_count = 0;
+}
+
+//Drops the table if $PATH is no longer the value it was filled against
+static void check_path_changed(void)
+{
+    const char *path_env = getenv("PATH");
+    if (!path_env) {
+        path_env = "";
+    }
+    if (path_cache_path && strcmp(path_cache_path, path_env) == 0) {
+        return;
+    }
+    clear_path_cache();
+    free(path_cache_path);
+    path_cache_path = strdup(path_env);
+}
+
+//Walks $PATH looking for an executable called name. Returns a malloc'd path or NULL.
+//*cacheable is cleared if the match came from a relative PATH entry (its meaning changes with cd)
+static char *search_path(const char *name, int *cacheable)
+{
+    const char *dir = path_cache_path;
+    size_t name_len = strlen(name);
+
+    *cacheable = 1;
+    while (dir) {
+        const char *colon = strchr(dir, ':');
+        size_t dir_len = colon ? (size_t)(colon - dir) : strlen(dir);
+
+        //An empty PATH entry means the current directory
+        const char *prefix = dir_len ? dir : ".";
+        size_t prefix_len = dir_len ? dir_len : 1;
+
+        char *candidate = malloc(prefix_len + name_len + 2);
+        if (!candidate) {
+            return NULL;
         }
-        if (dup2(fd, STDOUT_FILENO) == -1) {
-            perror("dup2 failed");
-            close(fd);
-            exit(1);
+        memcpy(candidate, prefix, prefix_len);
+        candidate[prefix_len] = '/';
+        memcpy(candidate + prefix_len + 1, name, name_len + 1);
+
+        struct stat st;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+            *cacheable = (prefix[0] == '/');
+            return candidate;
         }
+        free(candidate);
+
+        dir = colon ? colon + 1 : NULL;
     }
-    close(fd);
+    return NULL;
+}
 
-    if (execvp(args[ARG_PROGNAME], args) == -1) {
-        perror("execvp failed");
-        exit(1);
+/**
+ * resolve_command
+ * 
+ * Finds the program to exec for a command name, using the cache when possible.
+ * Names containing a '/' are paths already and are returned unchanged.
+ * 
+ * Returns a path owned by the cache (valid until the next cache update), or NULL if
+ * the command is not on $PATH.
+ */
+const char *resolve_command(const char *name)
+{
+    static char *uncached = NULL; //last result that could not be stored in the table
+
+    if (strchr(name, '/')) {
+        return name;
+    }
+
+    check_path_changed();
+
+    struct path_cache_entry *slot = path_cache_slot(name);
+    if (slot->name) { //cache hit
+        slot->hits++;
+        count_stat(STAT_PATH_HITS);
+        return slot->path;
+    }
+
+    count_stat(STAT_PATH_MISSES);
+    int cacheable;
+    char *path = search_path(name, &cacheable);
+    if (!path) {
+        return NULL;
     }
+
+    //Keep the table at most 3/4 full so probe sequences stay short
+    if (!cacheable || path_cache_count >= PATH_CACHE_SIZE * 3 / 4) {
+        free(uncached);
+        uncached = path;
+        return path;
+    }
+
+    slot->name = strdup(name);
+    slot->path = path;
+    slot->hits = 1;
+    path_cache_count++;
+    return path;
 }
 
-//Launches a child command within a pipe.
-//read_fd: fd to be duped onto stdin (or -1 if no pipe input)
-//write_fd: fd to be duped onto stdout (or -1 if no pipe output)
-static void child_with_pipes(char *args[], int argsc, int read_fd, int write_fd)
+//Removes a single command from the cache (used when its cached path fails to exec)
+void forget_command(const char *name)
 {
-    if (read_fd != - 1) {
-        if (dup2(read_fd, STDIN_FILENO) == -1) {
-            perror("dup2 failed");
-            exit(1);
-        }
-        close(read_fd);
+    if (path_cache_count == 0) {
+        return;
     }
 
-    if (write_fd != -1) {
-        if (dup2(write_fd, STDOUT_FILENO) == -1) {
-            perror("dup2 failed");
-            exit(1);
-        }
-        close(write_fd);
+    struct path_cache_entry *slot = path_cache_slot(name);
+    if (!slot->name) {
+        return;
     }
+    free(slot->name);
+    free(slot->path);
+    slot->name = NULL;
+    slot->path = NULL;
+    slot->hits = 0;
+    path_cache_count--;
 
-    execvp(args[ARG_PROGNAME], args);
-    perror("execvp failed");
-    exit(1);
+    //Re-insert the rest of the probe run so later lookups do not stop at the hole
+    unsigned int i = (unsigned int)(slot - path_cache);
+    i = (i + 1) & (PATH_CACHE_SIZE - 1);
+    while (path_cache[i].name != NULL) {
+        struct path_cache_entry moved = path_cache[i];
+        path_cache[i].name = NULL;
+        path_cache[i].path = NULL;
+        path_cache[i].hits = 0;
+        *path_cache_slot(moved.name) = moved;
+        i = (i + 1) & (PATH_CACHE_SIZE - 1);
+    }
 }
 
-//Launches a child command with both pipe input and file output redirection
-//read_fd: fd to be duped onto stdin (or -1 if no pipe input)
-//filename: file to redirect stdout to
-//append: 1 for append mode (>>), 0 for truncate mode (>)
-static void child_with_pipes_and_redirection(char *args[], int argsc, int read_fd, char *filename, int append)
+/**
+ * run_hash
+ * 
+ * The "hash" builtin, runs in the shell process so it works on the shell's own cache.
+ *  hash            -> lists cached commands with their hit counts
+ *  hash -r         -> clears the cache
+ *  hash name ...   -> looks the names up now, so later runs are already warm
+ * 
+ * Returns 0 on success, 1 if a name could not be found
+ */
+int run_hash(char *args[], int argsc)
 {
-    //Handle pipe input
-    if (read_fd != -1) {
-        if (dup2(read_fd, STDIN_FILENO) == -1) {
-            perror("dup2 failed");
-            exit(1);
+    if (argsc == 1) {
+        check_path_changed();
+        if (path_cache_count == 0) {
+            printf("hash: hash table empty\n");
+            return 0;
         }
-        close(read_fd);
+        printf("hits\tcommand\n");
+        for (int i = 0; i < PATH_CACHE_SIZE; i++) {
+            if (path_cache[i].name) {
+                printf("%4u\t%s\n", path_cache[i].hits, path_cache[i].path);
+            }
+        }
+        fflush(stdout);
+        return 0;
     }
 
-    //Handle file output redirection
-    int flags = O_WRONLY | O_CREAT;
-    flags |= append ? O_APPEND : O_TRUNC;
-    int fd = open(filename, flags, 0644);
-    if (fd == -1) {
-        perror("open failed");
-        exit(1);
+    if (strcmp(args[ARG_1], "-r") == 0) {
+        clear_path_cache();
+        return 0;
     }
-    if (dup2(fd, STDOUT_FILENO) == -1) {
-        perror("dup2 failed");
-        close(fd);
-        exit(1);
+
+    int status = 0;
+    for (int i = 1; i < argsc; i++) {
+        const char *path = resolve_command(args[i]);
+        if (!path) {
+            fprintf(stderr, "hash: %s: not found\n", args[i]);
+            status = 1;
+        } else if (path != args[i]) {
+            //pre-warming should not count as a use
+            struct path_cache_entry *slot = path_cache_slot(args[i]);
+            if (slot->name) {
+                slot->hits = 0;
+            }
+        }
     }
-    close(fd);
+    return status;
+}
+
+/**
+ * Zygote pool ("set zygotes=N")
+ * 
+ * posix_spawn() still creates the process when the command is started. With zygotes=N the
+ * shell keeps N idle helpers, forked ahead of time, so starting a program is just a message
+ * and an execv() in a process that already exists.
+ * 
+ * The shell never forks a helper itself, which would put the fork back in front of the next
+ * command. It forks one "master" process with nothing open but 0/1/2 and its socket, and
+ * asks it for helpers (an int: how many) without waiting. The master double-forks each one:
+ * the process in between writes the helper's pid into the helper's socket and exits, so the
+ * helper is adopted by the shell, a child subreaper (PR_SET_CHILD_SUBREAPER), and is the
+ * shell's child like one started by posix_spawn. Then the master sends the shell's end of
+ * that socket over as SCM_RIGHTS. The shell picks up whatever has arrived with
+ * MSG_DONTWAIT, between lines and when it needs a helper, and asks for a replacement for
+ * each one it uses. As the master has no fd of a command open, neither does a helper: an
+ * idle helper holding the write end of a pipe would keep its reader from seeing EOF.
+ * 
+ * Each helper holds one end of a SOCK_SEQPACKET socketpair and blocks in recvmsg(). A
+ * request is "cwd\0path\0argv[0]\0argv[1]\0..." with stdin, stdout and stderr attached as
+ * SCM_RIGHTS. The helper chdir()s, dup2()s them onto 0/1/2, unblocks SIGCHLD, answers
+ * with a 0 (ready to exec) and execs. Its socket is close-on-exec, so after the 0 the shell
+ * reads EOF once the exec has succeeded, or an errno if it failed. No 0 before EOF means
+ * the helper died without getting that far. Either failure falls back to posix_spawn,
+ * which reports the error. A helper is used once: it becomes the program. Helpers and the
+ * master exit when the shell closes its end of their socket.
+ */
+static int zygote_fds[MAX_ZYGOTES]; //shell ends of the helpers' sockets
+static pid_t zygote_pids[MAX_ZYGOTES];
+static int zygote_count = 0;
+static int zygote_master = -1; //shell end of the master's socket
+static int zygote_pending = 0; //helpers asked of the master and not received yet
+static pid_t zygote_owner = 0; //process the helpers are children of
 
-    execvp(args[ARG_PROGNAME], args);
-    perror("execvp failed");
-    exit(1);
+//Forgets helpers that belong to another process (a forked subshell inherits the parent's)
+//or that are no longer wanted. Closing our end makes an idle helper, or the master, exit.
+static void trim_zygotes(long keep)
+{
+    if (zygote_owner != getpid()) {
+        keep = 0;
+        zygote_owner = getpid();
+    }
+    while (zygote_count > keep) {
+        close(zygote_fds[--zygote_count]);
+    }
+    if (keep == 0 && zygote_master != -1) {
+        close(zygote_master);
+        zygote_master = -1;
+        zygote_pending = 0;
+    }
 }
 
-//This is the launch program function with redirection support.
-//We NUL-out the redirection tokens so that execvp sees only the real command arguments.
-//The child uses the helper function above to perform the actual redirection (child_with_redirection).
-//Parent path mirrors the basic launch_program logic.
-void launch_program_with_redirection(char *args[], int argsc)
+//Body of a helper: waits for one request and execs it. Never returns.
+static void zygote_main(int sock)
 {
-    char *filename = NULL;
-    int append = 0;
-    int input = 0;
+    static char request[ZYGOTE_MESSAGE_MAX];
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = { .iov_base = request, .iov_len = sizeof(request) - 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
 
-    int idx = find_redirection(args, argsc, &filename, &append, &input);
-    if (idx == -1 || filename == NULL) {
-        fprintf(stderr, "Redirection syntax error\n");
-        return;
+    ssize_t length = recvmsg(sock, &msg, 0);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (length <= 0 || !cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+        _exit(0); //the shell closed the socket: no longer needed
     }
+    request[length] = '\0';
 
-    args[idx] = NULL;
-    if (idx + 1 < argsc) 
-        args[idx + 1] = NULL;
-    
-    pid_t pid = fork();
+    int fds[3];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] != i) {
+            dup2(fds[i], i);
+            close(fds[i]);
+        }
+    }
 
-    if (pid == 0) {
-        child_with_redirection(args, argsc, filename, append, input);
-    } else if (pid > 0) {
-        return; //Parent waits using reap()
-    } else {
-        perror("fork failed");
+    //"cwd\0path\0argv..." -> argv array
+    char *argv[ZYGOTE_MESSAGE_MAX / 2];
+    int argc = 0;
+    char *cwd = request;
+    char *path = cwd + strlen(cwd) + 1;
+    for (char *arg = path + strlen(path) + 1; arg < request + length; arg += strlen(arg) + 1) {
+        argv[argc++] = arg;
+    }
+    argv[argc] = NULL;
+
+    sigset_t no_signals;
+    sigemptyset(&no_signals);
+    sigprocmask(SIG_SETMASK, &no_signals, NULL);
+
+    int err = 0;
+    if (chdir(cwd) == 0 && write(sock, &err, sizeof(err)) == sizeof(err)) {
+        execv(path, argv);
+    }
+    err = errno;
+    if (write(sock, &err, sizeof(err)) == -1) {
+        //nobody left to tell
     }
+    _exit(127);
 }
 
-//Launches a pipeline of commands
-void launch_pipeline(char *commands[], int command_count)
+//Body of the master: forks the helpers the shell asks for until it hangs up. Never returns.
+static void zygote_master_main(int control)
 {
-    int prev_read_fd = -1;
+    int wanted;
+    while (recv(control, &wanted, sizeof(wanted), 0) == sizeof(wanted)) {
+        for (; wanted > 0; wanted--) {
+            int sv[2];
+            char byte = 0;
+            char control_data[CMSG_SPACE(sizeof(int))];
+            memset(control_data, 0, sizeof(control_data));
+            struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+            struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
 
-    for (int i = 0; i < command_count; i++) {
-        //Check if this command is a subshell (check comes first)
-        if (command_with_subshell(commands[i])) {
-            char subshell_cmd[MAX_LINE];
-            if (extract_subshell_commands(commands[i], subshell_cmd)) {
-                //Subshell in pipeline - need special handling with I/O redirection
-                int pipe_fds[2] = {-1, -1};
-                if (i < command_count - 1) {
-                    if (pipe(pipe_fds) == -1) {
-                        perror("pipe failed");
-                        if (prev_read_fd != -1) close(prev_read_fd);
-                        return;
-                    }
-                }
-                
+            if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == 0) {
                 pid_t pid = fork();
-                if (pid == -1) {
-                    perror("fork failed");
-                    if (prev_read_fd != -1) close(prev_read_fd);
-                    if (pipe_fds[0] != -1) close(pipe_fds[0]);
-                    if (pipe_fds[1] != -1) close(pipe_fds[1]);
-                    return;
-                }
-                
                 if (pid == 0) {
-                    //Child: redirect stdin/stdout for pipeline
-                    if (prev_read_fd != -1) {
-                        if (dup2(prev_read_fd, STDIN_FILENO) == -1) {
-                            perror("dup2 failed");
-                            exit(1);
-                        }
-                        close(prev_read_fd);
+                    pid_t helper = fork();
+                    if (helper == 0) {
+                        close(control);
+                        close(sv[0]);
+                        zygote_main(sv[1]);
                     }
-                    if (pipe_fds[1] != -1) {
-                        if (dup2(pipe_fds[1], STDOUT_FILENO) == -1) {
-                            perror("dup2 failed");
-                            exit(1);
-                        }
-                        close(pipe_fds[1]);
+                    //The shell reads the pid first; no pid (EOF) if the fork failed
+                    if (helper > 0 && write(sv[1], &helper, sizeof(helper)) == -1) {
+                        //the shell's end is still open, this can't fail
                     }
-                    if (pipe_fds[0] != -1) close(pipe_fds[0]);
-                    
-                    // Instead of exec'ing a new s3 process, run the batched commands
-                    // inside this child after setting up I/O. This avoids argv/execvp
-                    // inconsistencies and keeps redirection local to the child.
-                    {
-                        char *batch_cmds[MAX_ARGS];
-                        int batch_count = 0;
-                        if (tokenize_batched_commands(subshell_cmd, batch_cmds, &batch_count)) {
-                            char lwd_local[MAX_PROMPT_LEN-6];
-                            init_lwd(lwd_local);
-                            launch_batched_commands(batch_cmds, batch_count, lwd_local);
-                        }
-                        exit(0);
-                    }
-                } else {
-                    //Parent: close fds and continue
-                    if (prev_read_fd != -1) close(prev_read_fd);
-                    if (pipe_fds[1] != -1) close(pipe_fds[1]);
-                    prev_read_fd = pipe_fds[0];
+                    _exit(0); //orphans the helper, the shell adopts it
+                }
+                close(sv[1]);
+                if (pid > 0) {
+                    waitpid(pid, NULL, 0);
                 }
-                continue; //Skip normal command processing
+
+                msg.msg_control = control_data;
+                msg.msg_controllen = sizeof(control_data);
+                struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+                memcpy(CMSG_DATA(cmsg), &sv[0], sizeof(int));
+            }
+            //Without an fd: this one couldn't be made, but the shell stops waiting for it
+            ssize_t sent = sendmsg(control, &msg, MSG_NOSIGNAL);
+            if (msg.msg_control) {
+                close(sv[0]);
+            }
+            if (sent == -1) {
+                _exit(0);
             }
         }
+    }
+    _exit(0);
+}
 
-        //Parse command and check arg count (moved below subshell check)
-        char *args[MAX_ARGS];
-        int argsc = 0;
-
-        parse_command(commands[i], args, &argsc);
-
-        if (argsc == 0) {
-            fprintf(stderr, "Empty command in pipeline\n");
-            if (prev_read_fd != -1) close(prev_read_fd);
-            return;
+//Starts the master, with nothing of the shell's open but 0/1/2. Returns 0 if it can't.
+static int start_zygote_master(void)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        return 0;
+    }
+    if (prctl(PR_SET_CHILD_SUBREAPER, 1) == -1) {
+        close(sv[0]);
+        close(sv[1]);
+        return 0;
+    }
+    fflush(stdout); //don't let the master inherit (and re-print) buffered output
+    pid_t pid = fork();
+    if (pid == 0) {
+        //The script, the trace file, the helpers' sockets and anything else the shell has
+        //open stay out of the master, and so out of the helpers and the programs
+        if (sv[1] > 3) {
+            close_range(3, sv[1] - 1, 0);
         }
+        close_range(sv[1] + 1, ~0U, 0);
+        zygote_master_main(sv[1]);
+    }
+    close(sv[1]);
+    if (pid == -1) {
+        close(sv[0]);
+        return 0;
+    }
+    count_stat(STAT_FORKS);
+    zygote_master = sv[0];
+    return 1;
+}
 
-        //Normal command processing (not a subshell)
-        int pipe_fds[2] = {-1, -1};
-        if (i < command_count - 1) {
-            if (pipe(pipe_fds) == -1) {
-                perror("pipe failed");
-                if(prev_read_fd != -1) close(prev_read_fd);
-                return;
-            }
+//Moves the helpers that have arrived from the master into the pool, without waiting
+static void receive_zygotes(void)
+{
+    while (zygote_pending > 0) {
+        char byte;
+        char control[CMSG_SPACE(sizeof(int))];
+        struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+        ssize_t length = recvmsg(zygote_master, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (length == -1 && (errno == EAGAIN || errno == EINTR)) {
+            return; //the rest are still being forked
         }
-
-        pid_t pid = fork();
-        if (pid == -1) {
-            perror("fork failed");
-            if (prev_read_fd != -1) close(prev_read_fd);
-            if (pipe_fds[0] != -1) close(pipe_fds[0]);
-            if (pipe_fds[1] != -1) close(pipe_fds[1]);
+        if (length <= 0) {
+            trim_zygotes(0); //the master is gone; the next fill_zygotes starts another
             return;
         }
+        zygote_pending--;
 
-        if (pid == 0) {
-            int read_fd = prev_read_fd;
-            int write_fd = (i < command_count - 1) ? pipe_fds[1] : -1;
-
-            if (pipe_fds[0] != -1) 
-                close(pipe_fds[0]); //Child doesn't need read end yet
-
-            //Check if last command has output redirection
-            if (i == command_count - 1) {
-                char *filename = NULL;
-                int append = 0;
-                int input = 0;
-                int redir_idx = find_redirection(args, argsc, &filename, &append, &input);
-
-                if (redir_idx != -1 && !input && filename != NULL) {
-                    //Last command has output redirection - strip operators and use combined helper
-                    args[redir_idx] = NULL;
-                    if (redir_idx + 1 < argsc)
-                        args[redir_idx + 1] = NULL;
-                    child_with_pipes_and_redirection(args, argsc, read_fd, filename, append);
-                } else {
-                    //Normal pipe handling (no redirection or input redirection)
-                    child_with_pipes(args, argsc, read_fd, write_fd);
-                }
-            } else {
-                //Not the last command - normal pipe handling
-                child_with_pipes(args, argsc, read_fd, write_fd);
-            }
-        } else {
-            if (prev_read_fd != -1)
-                close(prev_read_fd);
-
-            if (pipe_fds[1] != -1)
-                close(pipe_fds[1]);
-
-            prev_read_fd = pipe_fds[0];
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+            continue; //the master couldn't make this one
+        }
+        int sock;
+        memcpy(&sock, CMSG_DATA(cmsg), sizeof(int));
+        pid_t pid;
+        if (zygote_count == MAX_ZYGOTES || recv(sock, &pid, sizeof(pid), MSG_DONTWAIT) != sizeof(pid)) {
+            close(sock);
+            continue;
         }
+        count_stat(STAT_FORKS);
+        zygote_fds[zygote_count] = sock;
+        zygote_pids[zygote_count] = pid;
+        zygote_count++;
     }
+}
 
-    if (prev_read_fd != -1)
-        close(prev_read_fd);
+//Asks the master for the helpers the pool is short of, without waiting for them
+static void request_zygotes(long wanted)
+{
+    int missing = (int) (wanted < MAX_ZYGOTES ? wanted : MAX_ZYGOTES) - zygote_count - zygote_pending;
+    if (zygote_master != -1 && missing > 0
+        && send(zygote_master, &missing, sizeof(missing), MSG_DONTWAIT | MSG_NOSIGNAL) == sizeof(missing)) {
+        zygote_pending += missing;
+    }
+}
 
-    //Wait for all children in the pipeline
-    for (int i = 0; i < command_count; i++) {
-        reap();
+/**
+ * fill_zygotes
+ * 
+ * Collects the helpers the master has forked since the last call and asks it for as many
+ * as the pool is short of "set zygotes", starting the master on first use. Never waits for
+ * a fork: the helpers arrive while the shell goes on.
+ */
+void fill_zygotes(void)
+{
+    long wanted = get_option(OPT_ZYGOTES);
+    wanted = wanted < MAX_ZYGOTES ? wanted : MAX_ZYGOTES;
+    trim_zygotes(wanted);
+    if (wanted == 0 || (zygote_master == -1 && !start_zygote_master())) {
+        return;
     }
+    receive_zygotes();
+    request_zygotes(wanted);
 }
 
-// Executes a batch of commands sequentially, regardless of success/failure
-// Each command can be basic, have redirection, use pipes, or be a cd command
-void launch_batched_commands(char *commands[], int command_count, char lwd[])
+//Starts path in an idle helper. Returns its pid, or -1 if there is none or it couldn't exec.
+static pid_t zygote_spawn(const char *path, char *args[], int in_fd, int out_fd)
 {
-    for (int i = 0; i < command_count; i++) {
-        char * args[MAX_ARGS];
-        int argsc = 0;
+    static char request[ZYGOTE_MESSAGE_MAX];
+
+    long wanted = get_option(OPT_ZYGOTES);
+    trim_zygotes(wanted);
+    if (zygote_master != -1) {
+        receive_zygotes();
+    }
+    if (zygote_count == 0) {
+        return -1;
+    }
 
-        // Check for cd command first (must run in parent process)
-        if (is_cd(commands[i])) {
-            parse_command(commands[i], args, &argsc);
-            run_cd(args, argsc, lwd);
-            continue; // cd doesn't need reap()
+    size_t length = 0;
+    if (getcwd(request, PATH_MAX) == NULL) {
+        return -1;
+    }
+    length = strlen(request) + 1;
+    for (int i = -1; i == -1 || args[i] != NULL; i++) {
+        const char *text = i == -1 ? path : args[i];
+        size_t size = strlen(text) + 1;
+        if (length + size > sizeof(request)) {
+            return -1; //too big for one message, posix_spawn it
         }
+        memcpy(request + length, text, size);
+        length += size;
+    }
 
-        // Check command type before parsing (parsing modifies the string)
-        if (command_with_pipes(commands[i])) {
-            char * pipeline_cmds[MAX_ARGS];
-            int pipeline_count = 0;
+    int fds[3] = {in_fd != -1 ? in_fd : STDIN_FILENO, out_fd != -1 ? out_fd : STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { .iov_base = request, .iov_len = length };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
 
-            if (tokenize_pipeline(commands[i], pipeline_cmds, &pipeline_count)) {
-                launch_pipeline(pipeline_cmds, pipeline_count);
-            } else {
-                fprintf(stderr, "Pipeline parse error\n");
-            }
-            reap();
-            continue;
+    int sock = zygote_fds[--zygote_count];
+    pid_t pid = zygote_pids[zygote_count];
+    request_zygotes(wanted); //its replacement is forked by the master, not by us
+    int err = -1;
+    ssize_t reply = -1;
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t) length) {
+        //First a 0: the helper is about to exec. Then EOF: the exec closed the helper's
+        //end; or an int: why it failed.
+        while ((reply = recv(sock, &err, sizeof(err), 0)) == -1 && errno == EINTR) {
         }
-        else if (command_with_redirection(commands[i])) {
-            parse_command(commands[i], args, &argsc);
-            if (argsc == 0) {
-                continue;
-            }
-            launch_program_with_redirection(args, argsc);
-            reap();
-            continue;
-        }
-        else if (command_with_subshell(commands[i])) {
-            // Check for subshell (moved to bottom)
-            char subshell_cmd[MAX_LINE];
-            if (extract_subshell_commands(commands[i], subshell_cmd)) {
-                char *batch_commands[MAX_ARGS];
-                int batch_count = 0;
-                if (tokenize_batched_commands(subshell_cmd, batch_commands, &batch_count)){
-                    pid_t pid = fork();
-                    if (pid == 0){//child process
-                        launch_batched_commands(batch_commands, batch_count,lwd);
-                        exit(0);
-                    } else if (pid > 0) {//parent
-                        reap();
-                        continue;
-                    } else{
-                        fprintf(stderr, "fork failed in batched commands - command with subshell");
-                    }
-                }
-            } else {
-                fprintf(stderr, "Subshell command syntax error\n");
+        if (reply == sizeof(err) && err == 0) {
+            while ((reply = recv(sock, &err, sizeof(err), 0)) == -1 && errno == EINTR) {
             }
-            continue;
         } else {
-            parse_command(commands[i], args, &argsc);
-            if (argsc == 0) {
-                continue;
-            }
-            launch_program(args, argsc);
-            reap();
-            continue;
+            reply = -1; //EOF without the 0: it died before it got to exec
         }
     }
+    close(sock);
+    if (reply != 0) {
+        return -1; //the helper exits (or has died); reap_children collects it
+    }
+    count_stat(STAT_ZYGOTES);
+    return pid;
 }
 
-//Launches a subshell by forking and executing the shell binary with the subshell commands
-void launch_subshell(char *subshell_cmd)
+/**
+ * spawn_program
+ * 
+ * The spawn engine. Starts the binary named in args[ARG_PROGNAME] as a new process
+ * using posix_spawnp(), with file actions doing the dup2() work that child() used to do
+ * after fork().
+ * 
+ * Why not fork() + execvp()? fork() copies the page tables of the whole shell process,
+ * so every launch gets slower as the shell grows. glibc implements posix_spawn with
+ * clone(CLONE_VM | CLONE_VFORK), so nothing is copied and the cost stays flat.
+ * 
+ * args = array of strings. args contains the command and its arguments (NULL terminated)
+ * in_fd = fd to become the child's stdin, or -1 to keep the shell's stdin
+ * out_fd = fd to become the child's stdout, or -1 to keep the shell's stdout
+ * 
+ * in_fd/out_fd should be O_CLOEXEC (see open_redirection and pipe2 in launch_pipeline),
+ * so the only copies the program ends up with are its stdin/stdout.
+ * The caller still owns in_fd/out_fd and must close them afterwards.
+ * 
+ * Returns the pid of the child, or -1 if the program could not be started.
+ */
+pid_t spawn_program(char *args[], int in_fd, int out_fd)
 {
-    pid_t pid = fork();
+    mark_launch();
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
 
-    if (pid == -1) {
-        perror("fork failed");
-        return;
+    //The shell keeps SIGCHLD blocked (see init_jobs); programs start with nothing blocked
+    posix_spawnattr_t attr;
+    sigset_t no_signals;
+    sigemptyset(&no_signals);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &no_signals);
+
+    //run_builtin() ignores SIGPIPE while a builtin runs, and one may start a program
+    sigset_t default_signals;
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &default_signals);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    if (in_fd != -1 && in_fd != STDIN_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (out_fd != -1 && out_fd != STDOUT_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+
+    pid_t pid;
+    int err = ENOENT;
+    long long start = tracing() ? monotonic_ns() : 0;
+    const char *path = resolve_command(args[ARG_PROGNAME]);
+    int zygote = path && (pid = zygote_spawn(path, args, in_fd, out_fd)) != -1;
+    if (zygote) {
+        err = 0;
+    } else if (path) {
+        //exec the resolved path directly, no PATH walk
+        err = posix_spawn(&pid, path, &actions, &attr, args, environ);
+        if (err == ENOENT && path != args[ARG_PROGNAME]) {
+            //Cached binary has gone away - forget it and look it up once more
+            forget_command(args[ARG_PROGNAME]);
+            path = resolve_command(args[ARG_PROGNAME]);
+            err = path ? posix_spawn(&pid, path, &actions, &attr, args, environ) : ENOENT;
+        }
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (tracing()) {
+        trace_begin("spawn");
+        trace_int("child", err == 0 ? pid : -1);
+        trace_str("path", path ? path : "");
+        trace_argv("argv", args);
+        trace_int("stdin", in_fd);
+        trace_int("stdout", out_fd);
+        trace_int("zygote", zygote);
+        trace_int("dur_ns", monotonic_ns() - start);
+        if (err != 0) {
+            trace_str("error", strerror(err));
+        }
+        trace_end();
     }
 
-    if (pid == 0) { // Child process: execute the shell with the subshell command
-        char *subshell_args[3];
-        subshell_args[0] = "./s3"; // Path to shell binary
-        subshell_args[1] = subshell_cmd; // Command to execute
-        subshell_args[2] = NULL; // Null terminator
+    count_stat(STAT_COMMANDS);
+    if (err != 0) { //posix_spawn returns the error instead of setting errno
+        fprintf(stderr, "%s: %s\n", args[ARG_PROGNAME], strerror(err));
+        return -1;
+    }
+    count_stat(STAT_EXECS); //posix_spawn (or a zygote) is a fork and an exec in one
+    return pid;
+}
+
+/**
+ * exec_program
+ * 
+ * Replaces the current process with the program in args[ARG_PROGNAME], using the
+ * path from resolve_command(). Only used by processes that would exit straight after
+ * waiting for the program anyway (see exec_batched_commands).
+ * 
+ * Never returns: on failure the error is printed and the process exits with
+ * 127 (command not found) or 126 (found but could not be executed).
+ */
+void exec_program(char *args[])
+{
+    fflush(stdout); //exec throws away anything still buffered
+
+    //The shell keeps SIGCHLD blocked (see init_jobs); the program starts with nothing blocked
+    sigset_t no_signals;
+    sigemptyset(&no_signals);
+    sigprocmask(SIG_SETMASK, &no_signals, NULL);
+
+    const char *path = resolve_command(args[ARG_PROGNAME]);
+    if (tracing()) {
+        trace_begin("exec");
+        trace_str("path", path ? path : "");
+        trace_argv("argv", args);
+        trace_end();
+    }
+    if (path) {
+        execv(path, args);
+        if (errno == ENOENT && path != args[ARG_PROGNAME]) {
+            //Cached binary has gone away - forget it and look it up once more
+            forget_command(args[ARG_PROGNAME]);
+            path = resolve_command(args[ARG_PROGNAME]);
+            if (path) {
+                execv(path, args);
+            }
+        }
+    } else {
+        errno = ENOENT;
+    }
+
+    int err = errno;
+    fprintf(stderr, "%s: %s\n", args[ARG_PROGNAME], strerror(err));
+    shell_exit(err == ENOENT ? 127 : 126);
+}
+
+/**
+ * Job table
+ * 
+ * Every pipeline (a standalone command or subshell counts as a one-stage pipeline) becomes
+ * a job that records the pid and, once it has finished, the exit status of each stage.
+ * 
+ * SIGCHLD is kept blocked in the shell and delivered through a signalfd instead of a
+ * handler. Waiting for a job means: reap every child that has finished (waitpid with
+ * WNOHANG, whatever job it belongs to), and if our job is still running, sleep in poll()
+ * on the signalfd until the next SIGCHLD. So the shell never blocks on whichever child
+ * happens to finish first, and never steals a child that belongs to another job.
+ * 
+ * Background jobs ("cmd &") stay in the table with a job number until report_jobs()
+ * or the wait builtin finds them finished.
+ */
+static struct job **jobs = NULL; //jobs that have not been waited for yet
+static int job_count = 0;
+static int job_capacity = 0;
+static int sigchld_fd = -1; //signalfd for SIGCHLD
+static struct timespec launch_time; //when the child passed to the next job_add_stage() was started
+
+//Called right before a child is forked or spawned; job_add_stage() takes this as its start time
+void mark_launch(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &launch_time);
+}
+
+/**
+ * init_jobs
+ * 
+ * Blocks SIGCHLD and opens the signalfd used by wait_for_job. Called once at startup.
+ * Programs started by spawn_program/exec_program get an empty signal mask back.
+ */
+void init_jobs(void)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
 
-        execvp("./s3", subshell_args);
-        perror("execvp failed"); // If you reach here, execvp failed
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+        perror("sigprocmask failed");
         exit(1);
-        
     }
-    // Parent process: wait for the subshell to complete
-    // reap() will be called in the main loop
-}
\ No newline at end of file
+    sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigchld_fd == -1) {
+        perror("signalfd failed");
+        exit(1);
+    }
+}
+
+//Creates an empty job and adds it to the table
+struct job *new_job(void)
+{
+    struct job *job = calloc(1, sizeof(struct job));
+    if (!job) {
+        perror("malloc failed");
+        exit(1);
+    }
+
+    if (job_count == job_capacity) {
+        job_capacity = job_capacity ? job_capacity * 2 : 8;
+        jobs = realloc(jobs, job_capacity * sizeof(struct job *));
+        if (!jobs) {
+            perror("malloc failed");
+            exit(1);
+        }
+    }
+    jobs[job_count++] = job;
+    return job;
+}
+
+/**
+ * job_add_stage
+ * 
+ * Records the next stage of a job. pid = -1 means the stage could not be started
+ * (the error is already printed); it is recorded as finished with status 127.
+ */
+void job_add_stage(struct job *job, pid_t pid)
+{
+    if (job->stage_count == job->stage_capacity) {
+        job->stage_capacity = job->stage_capacity ? job->stage_capacity * 2 : 4;
+        job->pids = realloc(job->pids, job->stage_capacity * sizeof(pid_t));
+        job->statuses = realloc(job->statuses, job->stage_capacity * sizeof(int));
+        job->usages = realloc(job->usages, job->stage_capacity * sizeof(struct rusage));
+        job->finished = realloc(job->finished, job->stage_capacity * sizeof(struct timespec));
+        job->started = realloc(job->started, job->stage_capacity * sizeof(struct timespec));
+        if (!job->pids || !job->statuses || !job->usages || !job->finished || !job->started) {
+            perror("malloc failed");
+            exit(1);
+        }
+    }
+
+    job->pids[job->stage_count] = pid;
+    memset(&job->usages[job->stage_count], 0, sizeof(struct rusage));
+    job->started[job->stage_count] = launch_time;
+    job->finished[job->stage_count] = launch_time; //until it is reaped
+    if (pid > 0) {
+        job->statuses[job->stage_count] = -1; //still running
+        job->running++;
+    } else {
+        job->statuses[job->stage_count] = 127;
+    }
+    job->stage_count++;
+}
+
+//Removes a job from the table and frees it
+void free_job(struct job *job)
+{
+    for (int i = 0; i < job_count; i++) {
+        if (jobs[i] == job) {
+            jobs[i] = jobs[--job_count];
+            break;
+        }
+    }
+    free(job->pids);
+    free(job->statuses);
+    free(job->usages);
+    free(job->finished);
+    free(job->started);
+    free(job->text);
+    free(job);
+}
+
+//In a forked child: the parent's jobs are not our children, so drop them from our copy
+void clear_jobs(void)
+{
+    while (job_count > 0) {
+        free_job(jobs[job_count - 1]);
+    }
+}
+
+/**
+ * reap_children
+ * 
+ * Collects every child that has finished, without blocking, and stores its exit status
+ * (exit code, or 128 + signal number if it was killed) in the job it belongs to, along
+ * with its resource usage from wait4() and when it finished (for "time").
+ */
+void reap_children(void)
+{
+    struct signalfd_siginfo info;
+    while (read(sigchld_fd, &info, sizeof(info)) == sizeof(info)) {
+        //drain: SIGCHLDs merge, so the waitpid loop below is what finds every child
+    }
+
+    int status;
+    pid_t pid;
+    struct rusage usage;
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+        int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        for (int i = 0; i < job_count; i++) {
+            struct job *job = jobs[i];
+            for (int stage = 0; stage < job->stage_count; stage++) {
+                if (job->pids[stage] == pid) {
+                    job->statuses[stage] = code;
+                    job->usages[stage] = usage;
+                    job->finished[stage] = now;
+                    job->running--;
+
+                    long long run_ns = (now.tv_sec - job->started[stage].tv_sec) * 1000000000LL
+                                       + (now.tv_nsec - job->started[stage].tv_nsec);
+                    count_latency(run_ns);
+                    if (tracing()) {
+                        trace_begin("exit");
+                        trace_int("child", pid);
+                        trace_int("status", code);
+                        trace_int("run_ns", run_ns);
+                        trace_int("maxrss_kb", usage.ru_maxrss);
+                        trace_end();
+                    }
+                }
+            }
+        }
+    }
+}
+
+//Sleeps until the next SIGCHLD, then reaps. Returns 0 if poll() failed.
+static int wait_for_children(void)
+{
+    struct pollfd pfd = { .fd = sigchld_fd, .events = POLLIN };
+    if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+        perror("poll failed");
+        return 0;
+    }
+    reap_children();
+    return 1;
+}
+
+//Exit status of a finished job: the status of its last stage, like other shells
+static int job_status(struct job *job)
+{
+    return job->stage_count > 0 ? job->statuses[job->stage_count - 1] : 0;
+}
+
+/**
+ * wait_for_job
+ * 
+ * Sleeps until every stage of job has finished, reaping other jobs' children along the way.
+ * Does not free the job.
+ * 
+ * Returns the exit status of the job: the status of its last stage, like other shells.
+ */
+int wait_for_job(struct job *job)
+{
+    reap_children();
+    while (job->running > 0) {
+        if (!wait_for_children()) {
+            break;
+        }
+    }
+    return job_status(job);
+}
+
+//Starts tracking a single child, waits for it and forgets it. Returns its exit status.
+int wait_for_pid(pid_t pid)
+{
+    struct job *job = new_job();
+    job_add_stage(job, pid);
+    int status = wait_for_job(job);
+    free_job(job);
+    return status;
+}
+
+//Turns a started job into background job [id], using the lowest free job number
+static void make_background(struct job *job, const char *text)
+{
+    int id = 1;
+    for (int i = 0; i < job_count; i++) {
+        if (jobs[i]->id == id) {
+            id++;
+            i = -1; //start over: the table is not sorted
+        }
+    }
+    job->id = id;
+    job->text = strdup(text ? text : "");
+}
+
+//Prints "[id] state<TAB>command" for a background job
+static void print_job(FILE *out, struct job *job)
+{
+    if (job->running > 0) {
+        fprintf(out, "[%d] Running\t%s\n", job->id, job->text);
+    } else if (job_status(job) == 0) {
+        fprintf(out, "[%d] Done\t%s\n", job->id, job->text);
+    } else {
+        fprintf(out, "[%d] Exit %d\t%s\n", job->id, job_status(job), job->text);
+    }
+}
+
+/**
+ * report_jobs
+ * 
+ * Forgets every background job that has finished. Called before each line is read.
+ * 
+ * verbose = 1 to print "[id] Done ..." for each of them (interactive mode)
+ */
+void report_jobs(int verbose)
+{
+    reap_children();
+    for (int i = 0; i < job_count; ) {
+        struct job *job = jobs[i];
+        if (job->id > 0 && job->running == 0) {
+            if (verbose) {
+                print_job(stderr, job);
+            }
+            free_job(job); //moves the last job into slot i
+        } else {
+            i++;
+        }
+    }
+}
+
+//jobs: lists the background jobs
+static int builtin_jobs(char *args[], int argsc)
+{
+    (void) args;
+    (void) argsc;
+    reap_children();
+    for (int i = 0; i < job_count; i++) {
+        if (jobs[i]->id > 0) {
+            print_job(stdout, jobs[i]);
+        }
+    }
+    report_jobs(0); //finished jobs have now been reported
+    return 0;
+}
+
+//Finds a background job by "%id" or by the pid of one of its stages
+static struct job *find_background_job(const char *spec)
+{
+    for (int i = 0; i < job_count; i++) {
+        struct job *job = jobs[i];
+        if (job->id == 0) {
+            continue;
+        }
+        if (spec[0] == '%') {
+            if (job->id == atoi(spec + 1)) {
+                return job;
+            }
+            continue;
+        }
+        for (int stage = 0; stage < job->stage_count; stage++) {
+            if (job->pids[stage] == atoi(spec)) {
+                return job;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * builtin_wait
+ * 
+ * wait           waits for every background job, returns 0
+ * wait %1 1234   waits for job 1 and the job of pid 1234, returns the status of the last one
+ */
+static int builtin_wait(char *args[], int argsc)
+{
+    if (argsc == 1) {
+        for (int i = 0; i < job_count; ) {
+            if (jobs[i]->id > 0) {
+                wait_for_job(jobs[i]);
+                free_job(jobs[i]);
+            } else {
+                i++;
+            }
+        }
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = 1; i < argsc; i++) {
+        struct job *job = find_background_job(args[i]);
+        if (!job) {
+            fprintf(stderr, "wait: %s: no such job\n", args[i]);
+            status = 127;
+            continue;
+        }
+        status = wait_for_job(job);
+        free_job(job);
+    }
+    return status;
+}
+
+/**
+ * Shell options
+ * 
+ * Numeric settings, listed by "set" and changed with "set name=value" (values may end in
+ * K, M or G). ./s3 -j N is the same as "set jobs=N", and ./s3 -o name=value as "set".
+ * "pipesize=N" can also be written before a pipeline to apply to that pipeline only.
+ */
+struct shell_option
+{
+    const char *name;
+    long value;
+    const char *help;
+};
+
+static struct shell_option shell_options[OPT_COUNT] = {
+    [OPT_JOBS] = {"jobs", 0, "entries of a &&& group or scheduled batch running at once (0 = one per CPU)"},
+    [OPT_SCHEDULE] = {"schedule", 0, "1 = run independent entries of a ';' list in parallel"},
+    [OPT_REWRITE] = {"rewrite", 1, "0 = don't rewrite pipelines (cat f | x -> x < f, sort | uniq -> sort -u)"},
+    [OPT_PLAN] = {"plan", 0, "1 = show each rewritten pipeline on stderr"},
+    [OPT_PIPESIZE] = {"pipesize", 0, "buffer size of pipes between stages, e.g. 1M (0 = kernel default, 64K)"},
+    [OPT_CACHE_SIZE] = {"cache_size", 64L << 20, "bytes of results the cache prefix keeps on disk (least recently used go first)"},
+    [OPT_ZYGOTES] = {"zygotes", 0, "idle pre-forked helpers that exec programs (0 = posix_spawn each one)"},
+};
+
+//Returns the current value of an option, with defaults filled in
+long get_option(enum ShellOption option)
+{
+    long value = shell_options[option].value;
+    if (option == OPT_JOBS && value == 0) {
+        value = sysconf(_SC_NPROCESSORS_ONLN);
+        return value > 0 ? value : 1;
+    }
+    return value;
+}
+
+/**
+ * parse_option_value
+ * 
+ * Reads a non-negative option value, with an optional K, M or G suffix (powers of 1024),
+ * e.g. "4", "64K", "1M".
+ * 
+ * Returns 1 and sets *number, or 0 if value is not a valid number
+ */
+int parse_option_value(const char *value, long *number)
+{
+    char *end;
+    errno = 0;
+    long result = strtol(value, &end, 10);
+    if (end == value || result < 0 || errno == ERANGE) {
+        return 0;
+    }
+
+    int shift = 0;
+    switch (*end) {
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+    }
+    if (*end != '\0' || result > (LONG_MAX >> shift)) {
+        return 0;
+    }
+    *number = result << shift;
+    return 1;
+}
+
+//Sets the option called name from its text value. Returns 0 (after printing why) on error.
+int set_option(const char *name, const char *value)
+{
+    for (int i = 0; i < OPT_COUNT; i++) {
+        if (strcmp(shell_options[i].name, name) != 0) {
+            continue;
+        }
+        long number;
+        if (!parse_option_value(value, &number)) {
+            fprintf(stderr, "set: %s: invalid value '%s'\n", name, value);
+            return 0;
+        }
+        shell_options[i].value = number;
+        return 1;
+    }
+    fprintf(stderr, "set: %s: no such option\n", name);
+    return 0;
+}
+
+//set: lists the options, set name=value...: changes them
+static int builtin_set(char *args[], int argsc)
+{
+    if (argsc == 1) {
+        for (int i = 0; i < OPT_COUNT; i++) {
+            printf("%s=%ld\t# %s\n", shell_options[i].name, shell_options[i].value, shell_options[i].help);
+        }
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = 1; i < argsc; i++) {
+        char *equals = strchr(args[i], '=');
+        if (!equals) {
+            fprintf(stderr, "set: usage: set [name=value]...\n");
+            return 2;
+        }
+        *equals = '\0';
+        if (!set_option(args[i], equals + 1)) {
+            status = 1;
+        }
+        *equals = '=';
+    }
+    return status;
+}
+
+/**
+ * init_lwd
+ * 
+ * initialises a buffer (of LWD_SIZE characters) to store previous directory
+ * sets lwd[0] to '\0' which signals that there is no previous directory at init
+ */
+void init_lwd(char lwd[]){
+    char *cwd = getcwd(NULL, 0);
+
+    if (cwd != NULL && strlen(cwd) < LWD_SIZE){
+        //copies until we find '\0' and copies '\0' too
+        strcpy(lwd, cwd);
+    } else{
+        lwd[0] = '\0'; //no prev directory
+    }
+    free(cwd);
+}
+
+/**
+ * run_cd
+ * 
+ * Uses chdir() to change present working directory of the process
+ *  
+ * args = array of strings. args contains the command and its arguments
+ * argsc = number of strings in args
+ * lwd[] = array to store previous working directory
+ * 
+ * Edge case to handle: 
+ *  1) cd -: goes to previous directory
+ *  2) cd ..: goes to the directory above the current directory
+ *  3) cd : goes to home directory
+ *  4) cd a b: sends error (too many arguments)
+ *  5) cd non/existent/path/ : sends error (invalid file)
+ */
+int run_cd(char *args[], int argsc, char lwd[]) {
+    if (argsc > 2){ //too many arguments, throw cd error
+        fprintf(stderr, "cd error, too many arguments\n");
+        return -1;
+    }
+    
+    const char *path = NULL;
+    
+    if (argsc > 1 && args[1]){
+        if (strcmp(args[1], "-") == 0) { //if cd path is "-", go to previous directory
+            if (!lwd || lwd[0] == '\0') { //lwd does not exist
+                fprintf(stderr, "cd, no prev directory\n");
+                return -1;
+            }
+            path = lwd;
+        } else { //else go to specified path
+            path = args[1];
+        }
+    } else { //if cd path is blank, go to home file directory
+        path = getenv("HOME");
+    }
+
+    //path validation
+    if (!path || path[0] == '\0') {
+        fprintf(stderr, "cd error, path not set\n");
+        return -1;
+    }
+
+    char *oldpwd = getcwd(NULL, 0);
+
+    //Change directory to path with chdir
+    if (chdir(path) != 0) { //chdir returns -1 on failure
+        fprintf(stderr, "chdir error\n");
+        free(oldpwd);
+        return -1;
+    }
+
+    //set new lwd with oldpwd
+    //to manage working directories to allow for "cd -"
+    if (oldpwd && strlen(oldpwd) < LWD_SIZE){
+        //copies until we find '\0' and copies '\0' too
+        strcpy(lwd, oldpwd);
+    } else {
+        lwd[0] = '\0';
+    }
+
+    free(oldpwd);
+    return 0;
+}
+
+
+/**
+ * open_redirection
+ * 
+ * Opens the file named by a redirection operator, in the parent.
+ * Opening here (rather than in the child) lets spawn_program just dup2() the fd into place.
+ * 
+ * filename = file to open
+ * append = 1 for append mode (>>), 0 for truncate mode (>)
+ * input = 1 for input redirection (<), 0 for output redirection
+ * 
+ * Returns an O_CLOEXEC fd, or -1 on failure (error already printed)
+ */
+int open_redirection(char *filename, int append, int input)
+{
+    int fd;
+    if (input) {
+        fd = open(filename, O_RDONLY | O_CLOEXEC);
+    } else {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+        flags |= append ? O_APPEND : O_TRUNC;
+        fd = open(filename, flags, 0644);
+    }
+    if (fd == -1) {
+        perror("open failed");
+    }
+    return fd;
+}
+
+//Opens the input of an eliminated "cat file |" (see "Pipeline rewrites"). Like cat, a file
+//that can't be read is reported and reads as empty instead of failing the stage.
+static int open_cat_input(const char *file)
+{
+    struct stat st;
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd != -1 && fstat(fd, &st) == 0 && S_ISDIR(st.st_mode)) {
+        close(fd);
+        fd = -1;
+        errno = EISDIR;
+    }
+    if (fd == -1) {
+        fprintf(stderr, "cat: %s: %s\n", file, strerror(errno));
+        fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    return fd;
+}
+
+//Opens every redirection of a node in order; a later one of the same direction replaces
+//an earlier one (so "sort < in > out" works). *in_fd/*out_fd must start as -1.
+//Returns 0 (with nothing left open) if a file could not be opened.
+static int open_redirections(struct redirection *redirs, int *in_fd, int *out_fd)
+{
+    for (struct redirection *redir = redirs; redir != NULL; redir = redir->next) {
+        int input = (redir->type == REDIR_IN || redir->type == REDIR_CAT);
+        int fd = redir->type == REDIR_CAT ? open_cat_input(redir->file)
+                                          : open_redirection(redir->file, redir->type == REDIR_APPEND, input);
+        if (tracing()) {
+            trace_begin("redirect");
+            trace_str("file", redir->file);
+            trace_str("mode", redir->type == REDIR_CAT ? "cat" : redir->type == REDIR_APPEND ? ">>"
+                              : input ? "<" : ">");
+            trace_int("fd", fd);
+            trace_end();
+        }
+        if (fd == -1) {
+            if (*in_fd != -1) close(*in_fd);
+            if (*out_fd != -1) close(*out_fd);
+            *in_fd = *out_fd = -1;
+            return 0;
+        }
+
+        int *target = input ? in_fd : out_fd;
+        if (*target != -1) {
+            close(*target);
+        }
+        *target = fd;
+    }
+    return 1;
+}
+
+//dup2()s fd onto target and closes the original (used by forked children)
+static void move_fd(int fd, int target)
+{
+    if (fd == -1 || fd == target) {
+        return;
+    }
+    if (dup2(fd, target) == -1) {
+        perror("dup2 failed");
+        shell_exit(1);
+    }
+    close(fd);
+}
+
+/**
+ * Builtins
+ * 
+ * Trivial utilities that cost far more to fork+exec than to run. Standalone, they run
+ * inside the shell process (launch_program). As a pipeline stage they run in a forked
+ * child without any exec (launch_pipeline). "command name ..." skips this table and runs
+ * the external program instead. cat and cp only handle the plain forms themselves and run
+ * the real program for anything with options.
+ * 
+ * Each builtin takes args/argsc like main() and returns an exit status.
+ */
+
+//echo [-n] args... : prints the args separated by spaces
+static int builtin_echo(char *args[], int argsc)
+{
+    int i = 1;
+    int newline = 1;
+
+    if (argsc > 1 && strcmp(args[1], "-n") == 0) {
+        newline = 0;
+        i++;
+    }
+    for (; i < argsc; i++) {
+        fputs(args[i], stdout);
+        if (i < argsc - 1) {
+            putchar(' ');
+        }
+    }
+    if (newline) {
+        putchar('\n');
+    }
+    return 0;
+}
+
+//pwd : prints the current working directory
+static int builtin_pwd(char *args[], int argsc)
+{
+    (void) args;
+    (void) argsc;
+
+    char *cwd = getcwd(NULL, 0);
+    if (!cwd) {
+        perror("pwd");
+        return 1;
+    }
+    puts(cwd);
+    free(cwd);
+    return 0;
+}
+
+static int builtin_true(char *args[], int argsc)
+{
+    (void) args;
+    (void) argsc;
+    return 0;
+}
+
+static int builtin_false(char *args[], int argsc)
+{
+    (void) args;
+    (void) argsc;
+    return 1;
+}
+
+//Prints a printf-style escape sequence starting at *fmt (just after the '\'), moving *fmt on
+static void print_escape(const char **fmt)
+{
+    char ch = **fmt;
+    switch (ch) {
+    case 'n': putchar('\n'); break;
+    case 't': putchar('\t'); break;
+    case 'r': putchar('\r'); break;
+    case 'a': putchar('\a'); break;
+    case 'b': putchar('\b'); break;
+    case 'f': putchar('\f'); break;
+    case 'v': putchar('\v'); break;
+    case '\\': putchar('\\'); break;
+    case '\0': putchar('\\'); return; //lone backslash at the end
+    default: putchar('\\'); putchar(ch); break;
+    }
+    (*fmt)++;
+}
+
+/**
+ * printf format [args...]
+ * 
+ * Supports %s %b %c %d %i %u %o %x %X %% with flags, width and precision, and the usual
+ * backslash escapes. Like POSIX printf, the format is reused until every arg is consumed,
+ * and missing args count as "" or 0.
+ */
+static int builtin_printf(char *args[], int argsc)
+{
+    if (argsc < 2) {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+
+    int next = 2;
+    int status = 0;
+    do {
+        const char *fmt = args[1];
+        while (*fmt) {
+            if (*fmt == '\\') {
+                fmt++;
+                print_escape(&fmt);
+                continue;
+            }
+            if (*fmt != '%') {
+                putchar(*fmt++);
+                continue;
+            }
+            if (fmt[1] == '%') {
+                putchar('%');
+                fmt += 2;
+                continue;
+            }
+
+            //Copy "%[flags][width][.precision]" into spec, then add the conversion ourselves
+            char spec[32];
+            size_t len = 0;
+            spec[len++] = *fmt++;
+            while (*fmt && strchr("-+ #0123456789.", *fmt) && len < sizeof(spec) - 3) {
+                spec[len++] = *fmt++;
+            }
+            char conv = *fmt;
+            if (conv == '\0') {
+                fprintf(stderr, "printf: missing format character\n");
+                return 1;
+            }
+            fmt++;
+
+            const char *arg = next < argsc ? args[next++] : NULL;
+            if (conv == 's' || conv == 'b') {
+                spec[len++] = 's';
+                spec[len] = '\0';
+                printf(spec, arg ? arg : "");
+            } else if (conv == 'c') {
+                spec[len++] = 'c';
+                spec[len] = '\0';
+                printf(spec, arg && arg[0] ? arg[0] : '\0');
+            } else if (strchr("diuoxX", conv)) {
+                char *end = NULL;
+                long long value = arg ? strtoll(arg, &end, 0) : 0;
+                if (arg && (*end != '\0' || end == arg)) {
+                    fprintf(stderr, "printf: %s: invalid number\n", arg);
+                    status = 1;
+                }
+                spec[len++] = 'l';
+                spec[len++] = 'l';
+                spec[len++] = conv;
+                spec[len] = '\0';
+                printf(spec, value);
+            } else {
+                fprintf(stderr, "printf: %%%c: invalid directive\n", conv);
+                return 1;
+            }
+        }
+    } while (next < argsc && next > 2); //reuse the format only if it consumed something
+
+    return status;
+}
+
+//Evaluates "test" expressions with one to three operands. Returns 0 (true), 1 (false) or 2 (error)
+static int test_expression(char *args[], int argsc)
+{
+    if (argsc == 0) {
+        return 1;
+    }
+    if (strcmp(args[0], "!") == 0) {
+        int result = test_expression(args + 1, argsc - 1);
+        return result == 2 ? 2 : !result;
+    }
+    if (argsc == 1) { //true if the string is not empty
+        return args[0][0] == '\0';
+    }
+
+    if (argsc == 2) {
+        const char *op = args[0];
+        const char *operand = args[1];
+        struct stat st;
+
+        if (strcmp(op, "-n") == 0) return operand[0] == '\0';
+        if (strcmp(op, "-z") == 0) return operand[0] != '\0';
+        if (strcmp(op, "-e") == 0) return stat(operand, &st) != 0;
+        if (strcmp(op, "-f") == 0) return !(stat(operand, &st) == 0 && S_ISREG(st.st_mode));
+        if (strcmp(op, "-d") == 0) return !(stat(operand, &st) == 0 && S_ISDIR(st.st_mode));
+        if (strcmp(op, "-s") == 0) return !(stat(operand, &st) == 0 && st.st_size > 0);
+        if (strcmp(op, "-r") == 0) return access(operand, R_OK) != 0;
+        if (strcmp(op, "-w") == 0) return access(operand, W_OK) != 0;
+        if (strcmp(op, "-x") == 0) return access(operand, X_OK) != 0;
+        fprintf(stderr, "test: %s: unary operator expected\n", op);
+        return 2;
+    }
+
+    if (argsc == 3) {
+        const char *left = args[0];
+        const char *op = args[1];
+        const char *right = args[2];
+
+        if (strcmp(op, "=") == 0) return strcmp(left, right) != 0;
+        if (strcmp(op, "!=") == 0) return strcmp(left, right) == 0;
+
+        char *left_end;
+        char *right_end;
+        long long a = strtoll(left, &left_end, 10);
+        long long b = strtoll(right, &right_end, 10);
+        int numeric = (*left_end == '\0' && left_end != left && *right_end == '\0' && right_end != right);
+
+        if (op[0] == '-' && !numeric) {
+            fprintf(stderr, "test: integer expression expected\n");
+            return 2;
+        }
+        if (strcmp(op, "-eq") == 0) return !(a == b);
+        if (strcmp(op, "-ne") == 0) return !(a != b);
+        if (strcmp(op, "-lt") == 0) return !(a < b);
+        if (strcmp(op, "-le") == 0) return !(a <= b);
+        if (strcmp(op, "-gt") == 0) return !(a > b);
+        if (strcmp(op, "-ge") == 0) return !(a >= b);
+        fprintf(stderr, "test: %s: binary operator expected\n", op);
+        return 2;
+    }
+
+    fprintf(stderr, "test: too many arguments\n");
+    return 2;
+}
+
+//test expr / [ expr ]
+static int builtin_test(char *args[], int argsc)
+{
+    if (strcmp(args[ARG_PROGNAME], "[") == 0) {
+        if (strcmp(args[argsc - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
+        }
+        argsc--; //drop the "]"
+    }
+    return test_expression(args + 1, argsc - 1);
+}
+
+/**
+ * copy_fd
+ * 
+ * Copies everything from in_fd (from its current offset) to out_fd, letting the kernel
+ * move the bytes where it can instead of copying them through our memory:
+ *  - copy_file_range() between two regular files (can even share blocks on btrfs/xfs/nfs)
+ *  - sendfile() from a regular file to anything else (a pipe, a socket, a terminal)
+ *  - splice() when either side is a pipe
+ * Whenever the kernel refuses one (O_APPEND output, different filesystems on old kernels,
+ * a terminal...), the next one carries on from the current offsets, down to read/write.
+ * 
+ * Returns 0, or -1 with errno set if reading or writing failed
+ */
+#define COPY_CHUNK (1 << 30) //bytes asked for per zero-copy call
+static int copy_fd(int in_fd, int out_fd)
+{
+    static char buffer[1 << 17];
+    struct stat in_st;
+    struct stat out_st;
+    ssize_t n;
+
+    if (fstat(in_fd, &in_st) == -1 || fstat(out_fd, &out_st) == -1) {
+        return -1;
+    }
+
+    if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode)) {
+        while ((n = copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK, 0)) > 0 || (n == -1 && errno == EINTR)) {
+        }
+        if (n == 0) {
+            return 0;
+        }
+    }
+    if (S_ISREG(in_st.st_mode)) {
+        while ((n = sendfile(out_fd, in_fd, NULL, COPY_CHUNK)) > 0 || (n == -1 && errno == EINTR)) {
+        }
+        if (n == 0) {
+            return 0;
+        }
+    }
+    if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode)) {
+        while ((n = splice(in_fd, NULL, out_fd, NULL, COPY_CHUNK, SPLICE_F_MOVE)) > 0 || (n == -1 && errno == EINTR)) {
+        }
+        if (n == 0) {
+            return 0;
+        }
+    }
+
+    while ((n = read(in_fd, buffer, sizeof(buffer))) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        for (ssize_t done = 0; done < n; ) {
+            ssize_t written = write(out_fd, buffer + done, n - done);
+            if (written == -1) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            done += written;
+        }
+    }
+    return 0;
+}
+
+//Runs the external program args[0] (for options the builtins don't handle) and waits
+static int run_external(char *args[])
+{
+    return wait_for_pid(spawn_program(args, -1, -1));
+}
+
+//1 if the two fds are the same regular file
+static int is_same_file(int fd1, int fd2)
+{
+    struct stat st1;
+    struct stat st2;
+    return fstat(fd1, &st1) == 0 && fstat(fd2, &st2) == 0 && S_ISREG(st1.st_mode)
+        && st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino;
+}
+
+//cat [files...] : copies the files ("-" or none: stdin) to stdout. Options go to /bin/cat.
+static int builtin_cat(char *args[], int argsc)
+{
+    for (int i = 1; i < argsc; i++) {
+        if (args[i][0] == '-' && args[i][1] != '\0') {
+            return run_external(args);
+        }
+    }
+
+    int status = 0;
+    for (int i = (argsc > 1 ? 1 : 0); i < argsc; i++) {
+        int use_stdin = (i == 0 || strcmp(args[i], "-") == 0);
+        int fd = use_stdin ? STDIN_FILENO : open(args[i], O_RDONLY | O_CLOEXEC);
+        if (fd != -1 && is_same_file(fd, STDOUT_FILENO)) { //"cat a >> a" would never end
+            fprintf(stderr, "cat: %s: input file is output file\n", args[i]);
+            status = 1;
+        } else if (fd == -1 || copy_fd(fd, STDOUT_FILENO) == -1) {
+            if (errno == EPIPE) { //reader is gone (head), nothing more to do
+                status = 1;
+                if (fd != -1 && !use_stdin) close(fd);
+                break;
+            }
+            fprintf(stderr, "cat: %s: %s\n", use_stdin ? "-" : args[i], strerror(errno));
+            status = 1;
+        }
+        if (fd != -1 && !use_stdin) {
+            close(fd);
+        }
+    }
+    return status;
+}
+
+//Copies the regular file src to dst (a file, or an existing directory to copy into)
+static int copy_file(const char *src, const char *dst)
+{
+    struct stat src_st;
+    struct stat dst_st;
+    int in_fd = open(src, O_RDONLY | O_CLOEXEC);
+    if (in_fd == -1 || fstat(in_fd, &src_st) == -1) {
+        fprintf(stderr, "cp: cannot stat '%s': %s\n", src, strerror(errno));
+        if (in_fd != -1) close(in_fd);
+        return 1;
+    }
+
+    char *target = NULL;
+    if (stat(dst, &dst_st) == 0 && S_ISDIR(dst_st.st_mode)) {
+        const char *base = strrchr(src, '/') ? strrchr(src, '/') + 1 : src;
+        target = malloc(strlen(dst) + strlen(base) + 2);
+        if (!target) {
+            perror("malloc failed");
+            exit(1);
+        }
+        sprintf(target, "%s/%s", dst, base);
+        dst = target;
+    }
+
+    int status = 0;
+    if (stat(dst, &dst_st) == 0 && dst_st.st_dev == src_st.st_dev && dst_st.st_ino == src_st.st_ino) {
+        fprintf(stderr, "cp: '%s' and '%s' are the same file\n", src, dst);
+        status = 1;
+    } else {
+        int out_fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, src_st.st_mode & 0777);
+        if (out_fd == -1) {
+            fprintf(stderr, "cp: cannot create regular file '%s': %s\n", dst, strerror(errno));
+            status = 1;
+        } else {
+            if (copy_fd(in_fd, out_fd) == -1) {
+                fprintf(stderr, "cp: error copying '%s' to '%s': %s\n", src, dst, strerror(errno));
+                status = 1;
+            }
+            close(out_fd);
+        }
+    }
+    close(in_fd);
+    free(target);
+    return status;
+}
+
+//cp src dst, cp src... dir : copies regular files. Options and directories go to /bin/cp.
+static int builtin_cp(char *args[], int argsc)
+{
+    struct stat st;
+    if (argsc < 3) {
+        return run_external(args); //let cp print its usage
+    }
+    for (int i = 1; i < argsc; i++) {
+        if (args[i][0] == '-' || (i < argsc - 1 && (stat(args[i], &st) == -1 || !S_ISREG(st.st_mode)))) {
+            return run_external(args);
+        }
+    }
+
+    const char *dst = args[argsc - 1];
+    if (argsc > 3 && (stat(dst, &st) == -1 || !S_ISDIR(st.st_mode))) {
+        fprintf(stderr, "cp: target '%s' is not a directory\n", dst);
+        return 1;
+    }
+
+    int status = 0;
+    for (int i = 1; i < argsc - 1; i++) {
+        status |= copy_file(args[i], dst);
+    }
+    return status;
+}
+
+static const struct builtin builtins[] = {
+    {"echo", builtin_echo},
+    {"pwd", builtin_pwd},
+    {"true", builtin_true},
+    {"false", builtin_false},
+    {"printf", builtin_printf},
+    {"test", builtin_test},
+    {"[", builtin_test},
+    {"hash", run_hash},
+    {"jobs", builtin_jobs},
+    {"wait", builtin_wait},
+    {"set", builtin_set},
+    {"parallel", builtin_parallel},
+    {"cat", builtin_cat},
+    {"cp", builtin_cp},
+    {"s3stat", builtin_s3stat},
+};
+
+//Returns the builtin called name, or NULL if it is an external program
+const struct builtin *find_builtin(const char *name)
+{
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strcmp(builtins[i].name, name) == 0) {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+//Returns the argv to exec for cmd: "command name args" means "run the external name"
+static char **external_argv(struct command_node *cmd)
+{
+    if (strcmp(cmd->argv[ARG_PROGNAME], "command") == 0 && cmd->count > 1) {
+        return cmd->argv + 1;
+    }
+    return cmd->argv;
+}
+
+//Traces a finished builtin (run in the shell, or in a forked child)
+static void trace_builtin(struct command_node *cmd, int status, long long start)
+{
+    if (tracing()) {
+        trace_begin("builtin");
+        trace_argv("argv", cmd->argv);
+        trace_int("status", status);
+        trace_int("dur_ns", monotonic_ns() - start);
+        trace_end();
+    }
+}
+
+/**
+ * run_builtin
+ * 
+ * Runs a builtin inside the shell process, with the command's redirections applied
+ * to the shell's own stdin/stdout for the duration of the call.
+ * 
+ * Returns the builtin's exit status (1 if a redirection could not be opened)
+ */
+int run_builtin(const struct builtin *builtin, struct command_node *cmd)
+{
+    int redir_in = -1;
+    int redir_out = -1;
+    if (!open_redirections(cmd->redirs, &redir_in, &redir_out)) {
+        return 1;
+    }
+
+    //Park the shell's own stdin/stdout on spare fds while the builtin uses the files
+    int saved_in = -1;
+    int saved_out = -1;
+    fflush(stdout);
+    if (redir_in != -1) {
+        saved_in = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+        move_fd(redir_in, STDIN_FILENO);
+    }
+    if (redir_out != -1) {
+        saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+        move_fd(redir_out, STDOUT_FILENO);
+    }
+
+    //A reader that has gone away (./s3 -s script | head -1) must fail the builtin with
+    //EPIPE, not kill the shell with SIGPIPE
+    struct sigaction ignore = { .sa_handler = SIG_IGN };
+    struct sigaction saved_pipe;
+    sigaction(SIGPIPE, &ignore, &saved_pipe);
+
+    count_stat(STAT_COMMANDS);
+    count_stat(STAT_BUILTINS);
+    long long start = tracing() ? monotonic_ns() : 0;
+    int status = builtin->run(cmd->argv, cmd->count);
+    if (fflush(stdout) == EOF) {
+        __fpurge(stdout); //what could not be written would only fail again later
+        clearerr(stdout);
+        status = status ? status : 1;
+    }
+    sigaction(SIGPIPE, &saved_pipe, NULL);
+    trace_builtin(cmd, status, start);
+
+    if (saved_in != -1) {
+        move_fd(saved_in, STDIN_FILENO);
+    }
+    if (saved_out != -1) {
+        move_fd(saved_out, STDOUT_FILENO);
+    }
+    return status;
+}
+
+/**
+ * spawn_command
+ * 
+ * Starts a simple command node with in_fd/out_fd as stdin/stdout (-1 = inherit).
+ * The command's own redirections are applied on top, so a redirection on a pipeline
+ * stage wins over the pipe, as in other shells.
+ * 
+ * Returns the pid of the child, or -1 if nothing was started.
+ */
+pid_t spawn_command(struct command_node *cmd, int in_fd, int out_fd)
+{
+    int redir_in = -1;
+    int redir_out = -1;
+
+    if (!open_redirections(cmd->redirs, &redir_in, &redir_out)) {
+        return -1;
+    }
+
+    pid_t pid = spawn_program(external_argv(cmd),
+                              redir_in != -1 ? redir_in : in_fd,
+                              redir_out != -1 ? redir_out : out_fd);
+
+    //The child has its own copies
+    if (redir_in != -1) close(redir_in);
+    if (redir_out != -1) close(redir_out);
+    return pid;
+}
+
+//In a forked child: closes unused_fd, then makes in_fd/out_fd (or the node's own
+//redirections, which win over pipes) the child's stdin/stdout. Exits on failure.
+static void setup_child_io(struct redirection *redirs, int in_fd, int out_fd, int unused_fd)
+{
+    if (unused_fd != -1) {
+        close(unused_fd);
+    }
+
+    int redir_in = -1;
+    int redir_out = -1;
+    if (!open_redirections(redirs, &redir_in, &redir_out)) {
+        shell_exit(1);
+    }
+    if (redir_in != -1) { //redirection wins over the pipe
+        if (in_fd != -1) close(in_fd);
+        in_fd = redir_in;
+    }
+    if (redir_out != -1) {
+        if (out_fd != -1) close(out_fd);
+        out_fd = redir_out;
+    }
+    move_fd(in_fd, STDIN_FILENO);
+    move_fd(out_fd, STDOUT_FILENO);
+}
+
+//Counts and traces a fork of the shell (kind = "builtin" or "subshell")
+static void note_fork(pid_t child, const char *kind)
+{
+    if (child != -1) {
+        count_stat(STAT_FORKS);
+    }
+    if (tracing()) {
+        trace_begin("fork");
+        trace_int("child", child);
+        trace_str("kind", kind);
+        trace_end();
+    }
+}
+
+//Runs a builtin as a pipeline stage: forked like a subshell, but no exec is needed
+static pid_t fork_builtin(const struct builtin *builtin, struct command_node *cmd, int in_fd, int out_fd, int unused_fd)
+{
+    fflush(stdout); //don't let the child inherit (and re-print) buffered output
+    mark_launch();
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        perror("fork failed");
+        return -1;
+    }
+    if (pid == 0) {
+        clear_jobs();
+        setup_child_io(cmd->redirs, in_fd, out_fd, unused_fd);
+        long long start = tracing() ? monotonic_ns() : 0;
+        int status = builtin->run(cmd->argv, cmd->count);
+        fflush(stdout);
+        trace_builtin(cmd, status, start);
+        shell_exit(status);
+    }
+    count_stat(STAT_COMMANDS);
+    note_fork(pid, "builtin");
+    return pid;
+}
+
+///Exit status of the last list entry that ran: what $? expands to
+static int last_status = 0;
+
+//Overwrites every $? slot in word with the n digits
+static void expand_status_word(char *word, const char *digits, int n)
+{
+    char *slot;
+    while ((slot = strchr(word, STATUS_MARK)) != NULL) {
+        memcpy(slot, digits, n);
+        memmove(slot + n, slot + 3, strlen(slot + 3) + 1);
+    }
+}
+
+//Fills the $? slots of a stage's words and redirection files with last_status. A node
+//runs once, so the words are rewritten in place: digits go into the slot and the rest
+//moves up.
+static void expand_status(struct command_node *stage)
+{
+    if (!stage->has_status) {
+        return;
+    }
+    char digits[4];
+    int n = snprintf(digits, sizeof(digits), "%d", last_status & 0xff);
+    for (int i = 0; i < stage->count; i++) {
+        expand_status_word(stage->argv[i], digits, n);
+    }
+    for (struct redirection *redir = stage->redirs; redir != NULL; redir = redir->next) {
+        expand_status_word(redir->file, digits, n);
+    }
+    stage->has_status = 0;
+}
+
+//Fills in $? in every stage of a list entry: the words and redirections of its commands
+//and the redirections of its subshells (subshell bodies expand later, when the subshell
+//runs them)
+static void expand_entry_status(struct command_node *pipeline)
+{
+    for (struct command_node *stage = pipeline->children; stage != NULL; stage = stage->next) {
+        expand_status(stage);
+    }
+}
+
+//exit [n]: n defaults to the status of the last command
+static void run_exit(char *args[], int argsc)
+{
+    shell_exit(argsc > 1 ? atoi(args[ARG_1]) & 0xff : last_status);
+}
+
+/**
+ * launch_program
+ * 
+ * Runs a standalone simple command (with any redirections) and waits for it.
+ * Builtins run right here; anything else is started in a child process.
+ *
+ * Reference: Lecture 2 
+ *  
+ * cmd = NODE_COMMAND from the command tree
+ * 
+ * Edge case to handle: 
+ *  1) Empty args **MUST BE CONSIDERED**
+ *  2) "exit" command: shell (not the child) should exit, with $? unless given a status
+ *
+ * Returns the exit status of the command
+ */
+int launch_program(struct command_node *cmd)
+{
+    char **args = cmd->argv;
+
+    if (cmd->count == 0 || args[0] == NULL){ //empty command, nothing to launch
+        return 0;
+    }
+    if (strcmp(args[0], "exit") == 0){
+        run_exit(args, cmd->count);
+    }
+
+    const struct builtin *builtin = find_builtin(args[0]);
+    if (builtin){ //runs right here, no child at all
+        return run_builtin(builtin, cmd);
+    }
+
+    return wait_for_pid(spawn_command(cmd, -1, -1));
+}
+
+//Largest pipe buffer an unprivileged process may ask for (read once from /proc)
+static long pipe_max_size(void)
+{
+    static long max_size = 0;
+    if (max_size == 0) {
+        FILE *file = fopen("/proc/sys/fs/pipe-max-size", "r");
+        if (!file || fscanf(file, "%ld", &max_size) != 1 || max_size <= 0) {
+            max_size = 1 << 20; //the kernel's default limit
+        }
+        if (file) {
+            fclose(file);
+        }
+    }
+    return max_size;
+}
+
+/**
+ * start_pipeline
+ * 
+ * Starts every stage of a pipeline concurrently, wiring stdout of each stage to stdin
+ * of the next, and returns without waiting. Builtin stages are forked, so this also
+ * works for a one-stage pipeline that has to run in the background.
+ * 
+ * Pipes get a buffer of the pipeline's own pipesize= (or the pipesize option), capped at
+ * /proc/sys/fs/pipe-max-size; bigger pipes mean fewer context switches between stages
+ * that move a lot of data.
+ * 
+ * pipeline = NODE_PIPELINE from the command tree
+ * out_fd = fd for the last stage's stdout, or -1 to inherit (the caller keeps it open)
+ * lwd[] = last working directory, handed to subshell stages
+ * 
+ * Returns the job holding the stages (caller waits for it and frees it)
+ */
+struct job *start_pipeline(struct command_node *pipeline, int out_fd, char lwd[])
+{
+    int prev_read_fd = -1;
+    long pipe_size = pipeline->pipe_size ? pipeline->pipe_size : get_option(OPT_PIPESIZE);
+    if (pipe_size > pipe_max_size()) {
+        pipe_size = pipe_max_size();
+    }
+    struct job *job = new_job(); //one pid and exit status per stage
+
+    for (struct command_node *stage = pipeline->children; stage != NULL; stage = stage->next) {
+        //Pipes are O_CLOEXEC so spawned programs only keep the ends dup'd onto stdin/stdout
+        int pipe_fds[2] = {-1, -1};
+        if (stage->next != NULL) {
+            if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+                perror("pipe failed");
+                break;
+            }
+            if (pipe_size > 0) {
+                //A failure here (e.g. the user's pipe quota is used up) just leaves the default
+                fcntl(pipe_fds[1], F_SETPIPE_SZ, pipe_size);
+            }
+            count_stat(STAT_PIPES);
+            if (tracing()) {
+                trace_begin("pipe");
+                trace_int("read_fd", pipe_fds[0]);
+                trace_int("write_fd", pipe_fds[1]);
+                trace_int("size", fcntl(pipe_fds[1], F_GETPIPE_SZ));
+                trace_end();
+            }
+        }
+        int stage_out = stage->next != NULL ? pipe_fds[1] : out_fd;
+
+        //A stage that fails to start has already been reported; the rest of the pipeline
+        //still runs so that its neighbours see the pipe close and finish
+        pid_t pid;
+        if (stage->type == NODE_SUBSHELL) {
+            pid = launch_subshell(stage, prev_read_fd, stage_out, pipe_fds[0], lwd);
+        } else if (find_builtin(stage->argv[ARG_PROGNAME])) {
+            pid = fork_builtin(find_builtin(stage->argv[ARG_PROGNAME]), stage, prev_read_fd, stage_out, pipe_fds[0]);
+        } else {
+            pid = spawn_command(stage, prev_read_fd, stage_out);
+        }
+        job_add_stage(job, pid);
+
+        if (prev_read_fd != -1)
+            close(prev_read_fd);
+
+        if (pipe_fds[1] != -1)
+            close(pipe_fds[1]);
+
+        prev_read_fd = pipe_fds[0];
+    }
+
+    if (prev_read_fd != -1)
+        close(prev_read_fd);
+
+    return job;
+}
+
+/**
+ * launch_pipeline
+ * 
+ * Runs a pipeline (see start_pipeline) and waits for all of its stages.
+ * 
+ * Returns the exit status of the last stage
+ */
+int launch_pipeline(struct command_node *pipeline, char lwd[])
+{
+    long long start = tracing() ? monotonic_ns() : 0;
+    struct job *job = start_pipeline(pipeline, -1, lwd);
+    int status = wait_for_job(job);
+    free_job(job);
+
+    if (tracing()) {
+        trace_begin("pipeline");
+        trace_int("stages", pipeline->count);
+        trace_int("status", status);
+        trace_int("dur_ns", monotonic_ns() - start);
+        trace_end();
+    }
+    return status;
+}
+
+//Commands that have to run inside the shell process itself
+static int is_shell_builtin(const char *name)
+{
+    return strcmp(name, "cd") == 0 || strcmp(name, "exit") == 0 || find_builtin(name) != NULL;
+}
+
+/**
+ * "time" prefix
+ * 
+ * A timed pipeline is started like any other, and the job table keeps the wait4() rusage
+ * and the finishing time of every stage, so each stage is reported on its own:
+ * 
+ *       real      user       sys    maxrss    vcsw   ivcsw  stage
+ *     1.204s    0.951s    0.201s    52316K      12     310  sort big
+ *     1.210s    0.050s    0.090s     1876K    2050      21  tac
+ *     1.210s    1.001s    0.291s    52316K    2062     331  total
+ * 
+ * real is the time from the start of the pipeline to the end of the stage (CLOCK_MONOTONIC),
+ * so the slow stage is the one whose successors finish right after it. A subshell stage
+ * includes everything it ran. A builtin that runs inside the shell (cd, set...) and a
+ * "cache" pipeline (which may be a replay with nothing to wait for) are measured as one
+ * row with getrusage(RUSAGE_SELF) and getrusage(RUSAGE_CHILDREN) around them.
+ */
+
+static double seconds_between(struct timespec start, struct timespec end)
+{
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static double timeval_seconds(struct timeval tv)
+{
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void print_timing_row(double real, const struct rusage *usage)
+{
+    fprintf(stderr, "%9.3fs %9.3fs %9.3fs %9ldK %7ld %7ld  ", real,
+            timeval_seconds(usage->ru_utime), timeval_seconds(usage->ru_stime),
+            usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw);
+}
+
+//Prints one row per stage and a total row to stderr
+static void print_timing(struct command_node *stages, const struct rusage *usages,
+                         const struct timespec *finished, int count, struct timespec start, struct timespec end)
+{
+    struct rusage total;
+    memset(&total, 0, sizeof(total));
+
+    fprintf(stderr, "%10s %10s %10s %10s %7s %7s  %s\n", "real", "user", "sys", "maxrss", "vcsw", "ivcsw", "stage");
+    struct command_node *stage = stages;
+    for (int i = 0; i < count; i++, stage = stage->next) {
+        print_timing_row(seconds_between(start, finished[i]), &usages[i]);
+        print_node(stderr, stage);
+        fputc('\n', stderr);
+
+        timeradd(&total.ru_utime, &usages[i].ru_utime, &total.ru_utime);
+        timeradd(&total.ru_stime, &usages[i].ru_stime, &total.ru_stime);
+        if (usages[i].ru_maxrss > total.ru_maxrss) {
+            total.ru_maxrss = usages[i].ru_maxrss;
+        }
+        total.ru_nvcsw += usages[i].ru_nvcsw;
+        total.ru_nivcsw += usages[i].ru_nivcsw;
+    }
+    print_timing_row(seconds_between(start, end), &total);
+    fputs("total\n", stderr);
+}
+
+static int run_list_entry(struct command_node *pipeline, char lwd[]);
+
+//Runs a "time" pipeline and reports its resource usage. Returns its exit status.
+static int run_timed(struct command_node *pipeline, char lwd[])
+{
+    struct timespec start;
+    struct timespec end;
+    struct command_node *stage = pipeline->children;
+    int status;
+
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int in_shell = pipeline->count == 1 && stage->type == NODE_COMMAND && is_shell_builtin(stage->argv[ARG_PROGNAME]);
+    if (in_shell || pipeline->cached) {
+        //Runs inside the shell, or may not run at all (a cache hit): measure the shell and
+        //the children it waited for around it, as a single row
+        struct rusage before;
+        struct rusage children_before;
+        struct rusage usage;
+        struct rusage children;
+        getrusage(RUSAGE_SELF, &before);
+        getrusage(RUSAGE_CHILDREN, &children_before);
+        pipeline->timed = 0;
+        status = run_list_entry(pipeline, lwd);
+        getrusage(RUSAGE_SELF, &usage);
+        getrusage(RUSAGE_CHILDREN, &children);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        timersub(&usage.ru_utime, &before.ru_utime, &usage.ru_utime);
+        timersub(&usage.ru_stime, &before.ru_stime, &usage.ru_stime);
+        usage.ru_nvcsw -= before.ru_nvcsw;
+        usage.ru_nivcsw -= before.ru_nivcsw;
+        timersub(&children.ru_utime, &children_before.ru_utime, &children.ru_utime);
+        timersub(&children.ru_stime, &children_before.ru_stime, &children.ru_stime);
+        timeradd(&usage.ru_utime, &children.ru_utime, &usage.ru_utime);
+        timeradd(&usage.ru_stime, &children.ru_stime, &usage.ru_stime);
+        usage.ru_nvcsw += children.ru_nvcsw - children_before.ru_nvcsw;
+        usage.ru_nivcsw += children.ru_nivcsw - children_before.ru_nivcsw;
+        print_timing(in_shell ? stage : pipeline, &usage, &end, 1, start, end);
+        return status;
+    }
+
+    struct job *job = start_pipeline(pipeline, -1, lwd);
+    status = wait_for_job(job);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    print_timing(stage, job->usages, job->finished, job->stage_count, start, end);
+    free_job(job);
+    return status;
+}
+
+/**
+ * "cache" prefix
+ * 
+ * "cache sort txt/phrases.txt > txt/sorted.txt" runs the pipeline once, then replays its
+ * results for as long as nothing it depends on has changed. The key is the text of the
+ * pipeline plus everything that could change what it does:
+ *   - the working directory and the environment variables in cache_env[]
+ *   - (inode, size, mtime) of each program, each input redirection and each argument that
+ *     names an existing file; "-" for one that doesn't, so creating it is a change too
+ *   - the stdin the first stage inherits, if it has no '<' (see cache_stdin())
+ *   - whether the shell's stdout is a terminal, which programs (ls, grep --color=auto)
+ *     check to pick their output format
+ * The results are the pipeline's stdout and what it wrote to each '>' / '>>' file.
+ * 
+ * The store is $S3_CACHE_DIR (default ~/.cache/s3), one directory per FNV-1a hash of the
+ * key, holding the full key (compared on every hit, so a hash collision is only a miss),
+ * "stdout", and one numbered file per output redirection. A hit copies them out with
+ * copy_fd(), so copy_file_range() can share the blocks where the filesystem allows it.
+ * Only runs that exit with status 0 are stored; stderr is never stored. After each store,
+ * the least recently used entries (directory mtime, touched on every hit) are deleted until
+ * the store fits in "set cache_size".
+ */
+static const char *cache_env[] = {"PATH", "HOME", "LANG", "LC_ALL", "LC_COLLATE", "LC_CTYPE", "TZ"};
+
+//Returns the store directory, creating it on first use, or NULL if it can't be created
+static const char *cache_dir(void)
+{
+    static char dir[PATH_MAX];
+    if (dir[0] != '\0') {
+        return dir;
+    }
+
+    const char *env = getenv("S3_CACHE_DIR");
+    if (env && *env) {
+        snprintf(dir, sizeof(dir), "%s", env);
+    } else if (getenv("HOME")) {
+        snprintf(dir, sizeof(dir), "%s/.cache", getenv("HOME"));
+        mkdir(dir, 0755);
+        snprintf(dir, sizeof(dir), "%s/.cache/s3", getenv("HOME"));
+    } else {
+        return NULL;
+    }
+    if (strlen(dir) > PATH_MAX - 64) { //room for the entry and file names under it
+        fprintf(stderr, "%s: cache directory path too long\n", dir);
+        dir[0] = '\0';
+        return NULL;
+    }
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        perror(dir);
+        dir[0] = '\0';
+        return NULL;
+    }
+    return dir;
+}
+
+//Writes dir/name into path. Returns 0 if it doesn't fit in size bytes.
+static int join_path(char *path, size_t size, const char *dir, const char *name)
+{
+    int length = snprintf(path, size, "%s/%s", dir, name);
+    return length >= 0 && (size_t) length < size;
+}
+
+//Adds the state of one file to the key
+static void cache_key_file(FILE *key, const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        fprintf(key, "%s %lu %lld %lld.%09ld\n", path, (unsigned long) st.st_ino, (long long) st.st_size,
+                (long long) st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    } else {
+        fprintf(key, "%s -\n", path);
+    }
+}
+
+/**
+ * cache_stdin
+ * 
+ * Adds the stdin the first stage inherits to the key: a regular file by its state and
+ * offset, /dev/null by name. A pipe or a terminal can't be keyed without reading it to
+ * the end (which may never come, and takes the input from a command that wasn't going to
+ * read it), so the pipeline isn't cached.
+ * 
+ * Returns 1 if the key is complete, 0 if the pipeline can't be cached.
+ */
+static int cache_stdin(FILE *key)
+{
+    struct stat st;
+    struct stat null_st;
+    if (fstat(STDIN_FILENO, &st) == -1) {
+        fprintf(key, "stdin -\n"); //closed
+        return 1;
+    }
+    if (S_ISREG(st.st_mode)) {
+        fprintf(key, "stdin %lu %lld %lld.%09ld @%lld\n", (unsigned long) st.st_ino, (long long) st.st_size,
+                (long long) st.st_mtim.tv_sec, st.st_mtim.tv_nsec, (long long) lseek(STDIN_FILENO, 0, SEEK_CUR));
+        return 1;
+    }
+    if (S_ISCHR(st.st_mode) && stat("/dev/null", &null_st) == 0 && st.st_rdev == null_st.st_rdev) {
+        fprintf(key, "stdin /dev/null\n");
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * cache_key
+ * 
+ * Writes everything the results of pipeline depend on into a malloc'd string.
+ * 
+ * Returns the key, or NULL if the pipeline can't be cached (a subshell stage, whose body
+ * may read anything, a stdin cache_stdin() can't key, or a last stage that would write to
+ * a terminal: the miss would send its output to a file instead, so it wouldn't stream and
+ * the program would see a different stdout than it does uncached).
+ */
+static char *cache_key(struct command_node *pipeline, size_t *length)
+{
+    char *text = NULL;
+    FILE *key = open_memstream(&text, length);
+    if (!key) {
+        return NULL;
+    }
+
+    char *cwd = getcwd(NULL, 0);
+    fprintf(key, "cwd %s\n", cwd ? cwd : "?");
+    free(cwd);
+    for (size_t i = 0; i < sizeof(cache_env) / sizeof(cache_env[0]); i++) {
+        const char *value = getenv(cache_env[i]);
+        fprintf(key, "env %s=%s\n", cache_env[i], value ? value : "");
+    }
+    print_node(key, pipeline);
+    fputc('\n', key);
+
+    int ok = 1;
+    int reads_stdin = 1;
+    int writes_stdout = 1;
+    for (struct command_node *stage = pipeline->children; stage != NULL; stage = stage->next) {
+        if (stage->type != NODE_COMMAND) {
+            ok = 0;
+            break;
+        }
+        if (!find_builtin(stage->argv[ARG_PROGNAME])) {
+            const char *path = resolve_command(stage->argv[ARG_PROGNAME]);
+            cache_key_file(key, path ? path : stage->argv[ARG_PROGNAME]);
+        }
+        for (int i = 1; i < stage->count; i++) {
+            cache_key_file(key, stage->argv[i]);
+        }
+        for (struct redirection *redir = stage->redirs; redir != NULL; redir = redir->next) {
+            if (redir->type == REDIR_IN || redir->type == REDIR_CAT) {
+                cache_key_file(key, redir->file);
+                if (stage == pipeline->children) {
+                    reads_stdin = 0;
+                }
+            }
+            if ((redir->type == REDIR_OUT || redir->type == REDIR_APPEND) && stage->next == NULL) {
+                writes_stdout = 0;
+            }
+        }
+    }
+    if (ok && reads_stdin) {
+        ok = cache_stdin(key);
+    }
+    int stdout_tty = isatty(STDOUT_FILENO);
+    fprintf(key, "stdout %s\n", stdout_tty ? "tty" : "-");
+    if (stdout_tty && writes_stdout) {
+        ok = 0;
+    }
+
+    fclose(key);
+    if (!ok) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+static unsigned long long fnv1a(const char *data, size_t length)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char) data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+//Deletes an entry directory and the files in it
+static void cache_remove(const char *entry)
+{
+    DIR *dir = opendir(entry);
+    if (dir) {
+        struct dirent *file;
+        while ((file = readdir(dir)) != NULL) {
+            char path[PATH_MAX];
+            if (file->d_name[0] != '.' && join_path(path, sizeof(path), entry, file->d_name)) {
+                unlink(path);
+            }
+        }
+        closedir(dir);
+    }
+    rmdir(entry);
+}
+
+//Returns 1 if the entry directory holds exactly this key
+static int cache_key_matches(const char *entry, const char *key, size_t length)
+{
+    char path[PATH_MAX];
+    int fd = join_path(path, sizeof(path), entry, "key") ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    struct stat st;
+    int matches = 0;
+    if (fd != -1 && fstat(fd, &st) == 0 && (size_t) st.st_size == length) {
+        char *stored = malloc(length + 1);
+        matches = stored && read(fd, stored, length) == (ssize_t) length && memcmp(stored, key, length) == 0;
+        free(stored);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    return matches;
+}
+
+/**
+ * cache_replay
+ * 
+ * Writes the stored results back: stdout, then every output redirection in order. All the
+ * stored files are opened first, so an incomplete entry is found before anything is written.
+ * 
+ * Returns 1 on success, 0 if the entry can't be replayed and nothing has been written (a
+ * miss), or -1 if writing failed partway (the error has been printed).
+ */
+static int cache_replay(const char *entry, struct command_node *pipeline)
+{
+    int stored[65]; //stdout, then up to 64 output redirections (see run_cached())
+    int count = 0;
+    int outputs = 0;
+    for (struct command_node *stage = pipeline->children; stage != NULL; stage = stage->next) {
+        for (struct redirection *redir = stage->redirs; redir != NULL; redir = redir->next) {
+            outputs += redir->type == REDIR_OUT || redir->type == REDIR_APPEND;
+        }
+    }
+    int result = outputs < 64;
+    while (result && count <= outputs) {
+        char name[16] = "stdout";
+        if (count > 0) {
+            snprintf(name, sizeof(name), "%d", count - 1);
+        }
+        char path[PATH_MAX];
+        stored[count] = join_path(path, sizeof(path), entry, name) ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+        result = stored[count] != -1;
+        count += result;
+    }
+
+    //From here on the output is being written: a failure can't turn into a miss any more
+    fflush(stdout);
+    if (result && copy_fd(stored[0], STDOUT_FILENO) == -1) {
+        perror("cache: replay failed");
+        result = -1;
+    }
+    int index = 1;
+    for (struct command_node *stage = pipeline->children; stage != NULL && result == 1; stage = stage->next) {
+        for (struct redirection *redir = stage->redirs; redir != NULL && result == 1; redir = redir->next) {
+            if (redir->type != REDIR_OUT && redir->type != REDIR_APPEND) {
+                continue;
+            }
+            int fd = open_redirection(redir->file, redir->type == REDIR_APPEND, 0);
+            if (fd == -1) {
+                result = -1;
+            } else if (copy_fd(stored[index], fd) == -1) {
+                perror("cache: replay failed");
+                result = -1;
+            }
+            if (fd != -1) {
+                close(fd);
+            }
+            index++;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        close(stored[i]);
+    }
+    return result;
+}
+
+//Size in bytes of the files in an entry directory
+static long long cache_entry_size(const char *entry)
+{
+    long long size = 0;
+    DIR *dir = opendir(entry);
+    if (dir) {
+        struct dirent *file;
+        struct stat st;
+        while ((file = readdir(dir)) != NULL) {
+            if (file->d_name[0] != '.' && fstatat(dirfd(dir), file->d_name, &st, 0) == 0) {
+                size += st.st_size;
+            }
+        }
+        closedir(dir);
+    }
+    return size;
+}
+
+struct cache_entry_info {
+    char name[17]; //16 hex digits
+    struct timespec used;
+    long long size;
+};
+
+static int compare_entry_use(const void *a, const void *b)
+{
+    const struct cache_entry_info *x = a;
+    const struct cache_entry_info *y = b;
+    if (x->used.tv_sec != y->used.tv_sec) {
+        return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    }
+    return (x->used.tv_nsec > y->used.tv_nsec) - (x->used.tv_nsec < y->used.tv_nsec);
+}
+
+//Deletes least recently used entries until the store fits in the cache_size option
+static void cache_evict(const char *store)
+{
+    DIR *dir = opendir(store);
+    if (!dir) {
+        return;
+    }
+    struct cache_entry_info *entries = NULL;
+    int count = 0;
+    int capacity = 0;
+    long long total = 0;
+    struct dirent *file;
+    while ((file = readdir(dir)) != NULL) {
+        struct stat st;
+        if (strlen(file->d_name) != 16 || fstatat(dirfd(dir), file->d_name, &st, 0) == -1 || !S_ISDIR(st.st_mode)) {
+            continue; //not an entry (".", "..", a run in progress)
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            entries = realloc(entries, capacity * sizeof(struct cache_entry_info));
+            if (!entries) {
+                perror("malloc failed");
+                exit(1);
+            }
+        }
+        char path[PATH_MAX];
+        memcpy(entries[count].name, file->d_name, sizeof(entries[count].name));
+        entries[count].used = st.st_mtim;
+        entries[count].size = join_path(path, sizeof(path), store, file->d_name) ? cache_entry_size(path) : 0;
+        total += entries[count].size;
+        count++;
+    }
+    closedir(dir);
+
+    qsort(entries, count, sizeof(struct cache_entry_info), compare_entry_use);
+    for (int i = 0; i < count && total > get_option(OPT_CACHE_SIZE); i++) {
+        char path[PATH_MAX];
+        if (join_path(path, sizeof(path), store, entries[i].name)) {
+            cache_remove(path);
+        }
+        total -= entries[i].size;
+    }
+    free(entries);
+}
+
+/**
+ * run_cached
+ * 
+ * Runs a "cache" pipeline: replays the stored results if the key matches, otherwise runs
+ * it with stdout going to a file in the store, copies that to the real stdout, and keeps
+ * it (with a copy of each output redirection) if the pipeline succeeded.
+ * 
+ * Returns the exit status (0 for a replay).
+ */
+static int run_cached(struct command_node *pipeline, char lwd[])
+{
+    struct command_node *stage = pipeline->children;
+    const char *store = cache_dir();
+    size_t key_length;
+    char *key = NULL;
+
+    pipeline->cached = 0; //from here on it runs like any other pipeline
+    if (pipeline->count == 1 && stage->type == NODE_COMMAND && is_shell_builtin(stage->argv[ARG_PROGNAME])) {
+        return run_list_entry(pipeline, lwd); //runs inside the shell, nothing to replay
+    }
+    if (!store || !(key = cache_key(pipeline, &key_length))) {
+        return run_list_entry(pipeline, lwd);
+    }
+
+    char entry[PATH_MAX];
+    snprintf(entry, sizeof(entry), "%s/%016llx", store, fnv1a(key, key_length));
+    int replayed = cache_key_matches(entry, key, key_length) ? cache_replay(entry, pipeline) : 0;
+    if (replayed == -1) {
+        free(key);
+        return 1; //part of the output is out already, running it again would repeat it
+    }
+    if (replayed) {
+        utimensat(AT_FDCWD, entry, NULL, 0); //most recently used
+        count_stat(STAT_CACHE_HITS);
+        free(key);
+        return 0;
+    }
+    count_stat(STAT_CACHE_MISSES);
+
+    //Miss: run it with stdout going to the new entry. '>>' files only keep what this run adds.
+    char temp[PATH_MAX];
+    char path[PATH_MAX + 16];
+    snprintf(temp, sizeof(temp), "%s/run.%d", store, (int) getpid());
+    cache_remove(temp); //left over from a shell with the same pid that was killed
+    snprintf(path, sizeof(path), "%s/stdout", temp);
+    int out_fd = mkdir(temp, 0755) == 0 ? open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+    if (out_fd == -1) {
+        perror(temp);
+        free(key);
+        return run_list_entry(pipeline, lwd);
+    }
+
+    off_t appended_from[64];
+    int outputs = 0;
+    for (stage = pipeline->children; stage != NULL; stage = stage->next) {
+        for (struct redirection *redir = stage->redirs; redir != NULL; redir = redir->next) {
+            if ((redir->type == REDIR_OUT || redir->type == REDIR_APPEND) && outputs < 64) {
+                struct stat st;
+                appended_from[outputs++] = redir->type == REDIR_APPEND && stat(redir->file, &st) == 0 ? st.st_size : 0;
+            }
+        }
+    }
+
+    fflush(stdout);
+    struct job *job = start_pipeline(pipeline, out_fd, lwd);
+    int status = wait_for_job(job);
+    free_job(job);
+    lseek(out_fd, 0, SEEK_SET);
+    copy_fd(out_fd, STDOUT_FILENO);
+    close(out_fd);
+
+    int keep = (status == 0 && outputs < 64);
+    int index = 0;
+    for (stage = pipeline->children; stage != NULL && keep; stage = stage->next) {
+        for (struct redirection *redir = stage->redirs; redir != NULL && keep; redir = redir->next) {
+            if (redir->type != REDIR_OUT && redir->type != REDIR_APPEND) {
+                continue;
+            }
+            snprintf(path, sizeof(path), "%s/%d", temp, index);
+            //Only a regular file can be read back (think of "> /dev/tty"); others store nothing
+            struct stat st;
+            int in_fd = open(redir->file, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+            int copy_fd_out = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            keep = in_fd != -1 && copy_fd_out != -1 && fstat(in_fd, &st) == 0
+                   && (!S_ISREG(st.st_mode)
+                       || (lseek(in_fd, appended_from[index], SEEK_SET) != -1 && copy_fd(in_fd, copy_fd_out) == 0));
+            if (in_fd != -1) close(in_fd);
+            if (copy_fd_out != -1) close(copy_fd_out);
+            index++;
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s/key", temp);
+    int key_fd = keep ? open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+    keep = key_fd != -1 && write(key_fd, key, key_length) == (ssize_t) key_length;
+    if (key_fd != -1) {
+        close(key_fd);
+    }
+    free(key);
+
+    if (keep) {
+        cache_remove(entry); //an older result for the same hash
+        keep = rename(temp, entry) == 0;
+    }
+    if (keep) {
+        cache_evict(store);
+    } else {
+        cache_remove(temp);
+    }
+    return status;
+}
+
+//Runs one entry of a list (a pipeline, subshell, cd or plain command) and waits for it
+//Returns its exit status
+static int run_list_entry(struct command_node *pipeline, char lwd[])
+{
+    struct command_node *stage = pipeline->children;
+
+    if (pipeline->timed) {
+        return run_timed(pipeline, lwd);
+    }
+    else if (pipeline->cached) {
+        return run_cached(pipeline, lwd);
+    }
+    else if (pipeline->count > 1) {
+        return launch_pipeline(pipeline, lwd);
+    }
+    else if (stage->type == NODE_SUBSHELL) {
+        return wait_for_pid(launch_subshell(stage, -1, -1, -1, lwd));
+    }
+    else if (strcmp(stage->argv[ARG_PROGNAME], "cd") == 0) {
+        // cd must run in the shell process itself, there is nothing to wait for
+        return run_cd(stage->argv, stage->count, lwd) == 0 ? 0 : 1;
+    }
+    else {
+        return launch_program(stage);
+    }
+}
+
+/**
+ * start_list_entry
+ * 
+ * Starts a list entry without waiting for it, for '&' and '&&&'. Most entries are just
+ * their pipeline. One with a time or cache prefix, or a lone cd or exit, only means
+ * something to run_list_entry(), so it runs there in a forked copy of the shell (like a
+ * subshell: a cd in the background doesn't move the shell, "exit 3" is a status of 3).
+ * 
+ * out_fd = fd for its stdout, or -1 to inherit
+ * 
+ * Returns the job (for a forked copy, one stage: the copy).
+ */
+static struct job *start_list_entry(struct command_node *pipeline, int out_fd, char lwd[])
+{
+    struct command_node *stage = pipeline->children;
+    if (!pipeline->timed && !pipeline->cached
+        && !(pipeline->count == 1 && stage->type == NODE_COMMAND
+             && (strcmp(stage->argv[ARG_PROGNAME], "cd") == 0 || strcmp(stage->argv[ARG_PROGNAME], "exit") == 0))) {
+        return start_pipeline(pipeline, out_fd, lwd);
+    }
+
+    struct job *job = new_job();
+    fflush(stdout); //don't let the child inherit (and re-print) buffered output
+    mark_launch();
+    pid_t pid = fork();
+    if (pid == 0) {
+        clear_jobs();
+        setup_child_io(NULL, -1, out_fd, -1);
+        shell_exit(run_list_entry(pipeline, lwd));
+    }
+    if (pid == -1) {
+        perror("fork failed");
+    } else {
+        count_stat(STAT_SUBSHELLS);
+        note_fork(pid, "subshell");
+    }
+    job_add_stage(job, pid);
+    return job;
+}
+
+//Starts a "cmd &" entry as background job and moves on. Returns 0, like other shells.
+static int launch_background(struct command_node *pipeline, char lwd[])
+{
+    struct job *job = start_list_entry(pipeline, -1, lwd);
+    make_background(job, pipeline->text);
+    if (isatty(STDIN_FILENO) && job->stage_count > 0) {
+        fprintf(stderr, "[%d] %d\n", job->id, (int) job->pids[job->stage_count - 1]);
+    }
+    return 0;
+}
+
+//One entry of a '&&&' group or of a scheduled batch, while it is being run
+struct parallel_entry
+{
+    struct job *job; //NULL until the entry is started, and again once it is done
+    int out_fd; //memfd its stdout goes to, -1 if none could be made (it then writes to stdout)
+    int started;
+    int done;
+    int status;
+};
+
+//Copies the output an entry left in its memfd to our stdout, and closes the memfd
+static void flush_captured_output(int fd)
+{
+    char buffer[8192];
+    off_t offset = 0;
+    ssize_t n;
+
+    fflush(stdout);
+    while ((n = pread(fd, buffer, sizeof(buffer), offset)) > 0) {
+        offset += n;
+        for (ssize_t done = 0; done < n; ) {
+            ssize_t written = write(STDOUT_FILENO, buffer + done, n - done);
+            if (written == -1) {
+                if (errno == EINTR) continue;
+                perror("write failed");
+                close(fd);
+                return;
+            }
+            done += written;
+        }
+    }
+    close(fd);
+}
+
+/**
+ * run_concurrently
+ * 
+ * Runs count consecutive list entries at the same time, at most limit of them at once:
+ * whenever one finishes, the first entry that is ready starts. Each entry's stdout
+ * goes to its own memfd, and is copied to our stdout once the entry and every entry before
+ * it are done. So the output comes out in list order, as if the entries had run one after
+ * another. stderr is not held back.
+ * 
+ * first = first entry; the others follow it through ->next
+ * after = NULL, or a count x count matrix: after[j * count + i] set means entry j may only
+ *         start once entry i (i < j) has finished
+ * limit = most entries running at once
+ * lwd[] = last working directory, handed to subshell entries
+ * failed = if not NULL, set to the number of entries with a non-zero exit status
+ * 
+ * Returns the exit status of the last entry, as with ';'
+ */
+static int run_concurrently(struct command_node *first, int count, const unsigned char *after, long limit, char lwd[], int *failed)
+{
+    struct parallel_entry *entries = calloc(count, sizeof(struct parallel_entry));
+    struct command_node **nodes = malloc(count * sizeof(struct command_node *));
+    if (!entries || !nodes) {
+        perror("malloc failed");
+        exit(1);
+    }
+    nodes[0] = first;
+    for (int i = 1; i < count; i++) {
+        nodes[i] = nodes[i - 1]->next;
+    }
+
+    int printed = 0; //entries [0, printed) are done and their output copied out
+    int started_end = 0; //entries from here on have not been started
+    int status = 0;
+    if (failed) {
+        *failed = 0;
+    }
+
+    while (printed < count) {
+        reap_children();
+        long running = 0;
+        for (int i = printed; i < started_end; i++) {
+            struct parallel_entry *entry = &entries[i];
+            if (entry->job && entry->job->running == 0) {
+                entry->status = job_status(entry->job);
+                entry->done = 1;
+                free_job(entry->job);
+                entry->job = NULL;
+            } else if (entry->job) {
+                running++;
+            }
+        }
+
+        //Start ready entries, earliest first
+        for (int j = printed; j < count && running < limit; j++) {
+            int ready = !entries[j].started;
+            for (int i = printed; ready && after && i < j; i++) {
+                ready = !after[j * count + i] || entries[i].done;
+            }
+            if (!ready) {
+                continue;
+            }
+
+            entries[j].out_fd = memfd_create("s3-parallel", MFD_CLOEXEC);
+            if (entries[j].out_fd == -1) {
+                perror("memfd_create failed");
+            }
+            entries[j].job = start_list_entry(nodes[j], entries[j].out_fd, lwd);
+            entries[j].started = 1;
+            if (j >= started_end) {
+                started_end = j + 1;
+            }
+            if (entries[j].job->running > 0) {
+                running++;
+            }
+        }
+
+        while (printed < count && entries[printed].done) {
+            if (entries[printed].out_fd != -1) {
+                flush_captured_output(entries[printed].out_fd);
+            }
+            status = entries[printed].status;
+            if (failed && status != 0) {
+                (*failed)++;
+            }
+            printed++;
+        }
+
+        //Nothing running means an entry just finished without a child (it could not start):
+        //there is no SIGCHLD to wait for, go round again
+        if (printed < count && running > 0 && !wait_for_children()) {
+            break;
+        }
+    }
+
+    //Only reached early if poll() failed: don't leave the jobs behind
+    for (; printed < count; printed++) {
+        if (entries[printed].job) {
+            free_job(entries[printed].job);
+        }
+        if (entries[printed].started && entries[printed].out_fd != -1) {
+            close(entries[printed].out_fd);
+        }
+    }
+    free(nodes);
+    free(entries);
+    return status;
+}
+
+/**
+ * launch_parallel_group
+ * 
+ * Runs the entries of a '&&&' group ("a &&& b &&& c") at the same time, with no ordering
+ * between them (see run_concurrently).
+ * 
+ * first = first entry of the group; the group ends at the first entry not followed by '&&&'
+ * lwd[] = last working directory, handed to subshell entries
+ * 
+ * Returns the exit status of the last entry of the group, as with ';'
+ */
+int launch_parallel_group(struct command_node *first, char lwd[])
+{
+    int count = 1;
+    for (struct command_node *entry = first; entry->op == OP_PARALLEL && entry->next != NULL; entry = entry->next) {
+        count++;
+    }
+    return run_concurrently(first, count, NULL, get_option(OPT_JOBS), lwd, NULL);
+}
+
+/**
+ * parallel builtin
+ * 
+ * Each item becomes a one-command list entry built in parallel_arena, and the entries are
+ * handed to run_concurrently. Its N slots act as the worker pool: a slot takes the next
+ * queued item the moment its command finishes, so no slot idles while items are left.
+ */
+static struct arena parallel_arena; //reset after every run, like the per-line arena
+
+//Returns arg with every "{}" replaced by item (arg itself if it has none)
+static char *replace_braces(const char *arg, const char *item)
+{
+    size_t braces = 0;
+    for (const char *pos = strstr(arg, "{}"); pos != NULL; pos = strstr(pos + 2, "{}")) {
+        braces++;
+    }
+    if (braces == 0) {
+        return (char *) arg;
+    }
+
+    size_t item_len = strlen(item);
+    char *out = arena_alloc(&parallel_arena, strlen(arg) + braces * item_len - 2 * braces + 1);
+    char *end = out;
+    for (const char *pos = arg; *pos; ) {
+        if (pos[0] == '{' && pos[1] == '}') {
+            memcpy(end, item, item_len);
+            end += item_len;
+            pos += 2;
+        } else {
+            *end++ = *pos++;
+        }
+    }
+    *end = '\0';
+    return out;
+}
+
+//Builds the list entry (a one-stage pipeline) that runs cmd for item
+static struct command_node *parallel_entry_for(char *cmd[], int cmd_count, const char *item)
+{
+    struct command_node *command = new_node(&parallel_arena, NODE_COMMAND);
+    command->argv = arena_alloc(&parallel_arena, (cmd_count + 2) * sizeof(char *));
+
+    int replaced = 0;
+    for (int i = 0; i < cmd_count; i++) {
+        command->argv[i] = replace_braces(cmd[i], item);
+        replaced |= command->argv[i] != cmd[i];
+    }
+    command->count = cmd_count;
+    if (!replaced) { //no {}: the item is the last argument, as with xargs -n 1
+        size_t len = strlen(item);
+        char *copy = arena_alloc(&parallel_arena, len + 1);
+        memcpy(copy, item, len + 1);
+        command->argv[command->count++] = copy;
+    }
+    command->argv[command->count] = NULL;
+
+    struct command_node *pipeline = new_node(&parallel_arena, NODE_PIPELINE);
+    pipeline->children = command;
+    pipeline->count = 1;
+    return pipeline;
+}
+
+/**
+ * builtin_parallel
+ * 
+ * parallel [-j N] cmd [args] ::: item...   runs cmd once per item
+ * parallel [-j N] cmd [args]               same, one item per line of stdin
+ * 
+ * {} in an argument is replaced by the item ("gzip -k {}", "cp {} {}.bak"); with no {}
+ * the item is added as the last argument. Up to N commands (default: the jobs option) run
+ * at once, and each one's output is printed whole, in item order.
+ * 
+ * Returns 0 if every command succeeded, else how many failed (at most 101, as GNU parallel)
+ */
+int builtin_parallel(char *args[], int argsc)
+{
+    long limit = get_option(OPT_JOBS);
+    int first_arg = 1;
+    if (argsc > 2 && strcmp(args[1], "-j") == 0) {
+        char *end;
+        limit = strtol(args[2], &end, 10);
+        if (end == args[2] || *end != '\0' || limit < 0) {
+            fprintf(stderr, "parallel: -j: invalid value '%s'\n", args[2]);
+            return 2;
+        }
+        if (limit == 0) {
+            limit = get_option(OPT_JOBS);
+        }
+        first_arg = 3;
+    }
+
+    int cmd_count = 0;
+    while (first_arg + cmd_count < argsc && strcmp(args[first_arg + cmd_count], ":::") != 0) {
+        cmd_count++;
+    }
+    if (cmd_count == 0) {
+        fprintf(stderr, "parallel: usage: parallel [-j N] command [args] [::: items...]\n");
+        return 2;
+    }
+    char **cmd = args + first_arg;
+
+    struct command_node *first = NULL;
+    struct command_node **tail = &first;
+    int count = 0;
+    int items_at = first_arg + cmd_count + 1; //after ":::"
+    if (items_at <= argsc) {
+        for (int i = items_at; i < argsc; i++, count++) {
+            *tail = parallel_entry_for(cmd, cmd_count, args[i]);
+            tail = &(*tail)->next;
+        }
+    } else {
+        //Read stdin through our own FILE on a dup, so whatever stdin is right now (a pipe or
+        //a '<' redirection) is read from its current position
+        FILE *input = fdopen(dup(STDIN_FILENO), "r");
+        if (!input) {
+            perror("parallel: stdin");
+            return 2;
+        }
+        char *line = NULL;
+        size_t line_cap = 0;
+        ssize_t len;
+        while ((len = getline(&line, &line_cap, input)) != -1) {
+            if (len > 0 && line[len - 1] == '\n') {
+                line[len - 1] = '\0';
+            }
+            *tail = parallel_entry_for(cmd, cmd_count, line);
+            tail = &(*tail)->next;
+            count++;
+        }
+        free(line);
+        fclose(input);
+    }
+
+    int failed = 0;
+    if (count > 0) {
+        run_concurrently(first, count, NULL, limit, NULL, &failed);
+    }
+    arena_reset(&parallel_arena);
+    return failed > 101 ? 101 : failed;
+}
+
+/**
+ * Batch scheduler ("set schedule=1")
+ * 
+ * Runs the entries of a ';' list concurrently where that cannot change the result, e.g.
+ * "sort a > x ; sort b > y ; cat x y > z" runs both sorts at once, then cat.
+ * Every entry is reduced to the files it may touch:
+ *  - '<' targets are reads, '>' and '>>' targets are writes
+ *  - every other argument that is not an option (-x) may be a file the program reads or
+ *    writes (cp, rm, tee...), so it counts as a write
+ *  - the program itself, if named by a path (./prog), is a read
+ * Paths are made absolute and normalised ("./x", "x" and "$PWD/x" are one file), and a
+ * directory conflicts with everything below it. Entry j waits for an earlier entry i if
+ * they share a file and either of them writes it. Commands that change the shell itself
+ * (cd, exit, set, hash, wait, jobs) are barriers: everything before them finishes first.
+ * So are entries whose files can't be listed: a command with no file arguments ("ls",
+ * "make": the cwd is implied) and a subshell that runs cd (the names after it are
+ * relative to another directory). Output is in list order, as for '&&&'.
+ */
+struct file_uses
+{
+    char **paths; //normalised absolute paths (malloc'd)
+    unsigned char *writes; //1 if the matching path may be written
+    int count;
+    int capacity;
+};
+
+//Appends path to the absolute, normalised form of name: "." and "" components are dropped
+//and ".." removes the previous one. (Symlinks are not resolved.)
+static char *normalise_path(const char *cwd, const char *name)
+{
+    size_t size = strlen(cwd) + strlen(name) + 3;
+    char *path = malloc(size);
+    if (!path) {
+        perror("malloc failed");
+        exit(1);
+    }
+
+    size_t len = 0;
+    const char *parts[2] = { name[0] == '/' ? "" : cwd, name };
+    for (int p = 0; p < 2; p++) {
+        const char *pos = parts[p];
+        while (*pos) {
+            while (*pos == '/') pos++;
+            size_t part = strcspn(pos, "/");
+            if (part == 0 || (part == 1 && pos[0] == '.')) {
+                //nothing to add
+            } else if (part == 2 && pos[0] == '.' && pos[1] == '.') {
+                while (len > 0 && path[--len] != '/') {
+                    //back to the previous '/'
+                }
+            } else {
+                path[len++] = '/';
+                memcpy(path + len, pos, part);
+                len += part;
+            }
+            pos += part;
+        }
+    }
+    if (len == 0) {
+        path[len++] = '/';
+    }
+    path[len] = '\0';
+    return path;
+}
+
+static void add_file_use(struct file_uses *uses, const char *cwd, const char *name, int write)
+{
+    if (uses->count == uses->capacity) {
+        uses->capacity = uses->capacity ? uses->capacity * 2 : 8;
+        uses->paths = realloc(uses->paths, uses->capacity * sizeof(char *));
+        uses->writes = realloc(uses->writes, uses->capacity);
+        if (!uses->paths || !uses->writes) {
+            perror("malloc failed");
+            exit(1);
+        }
+    }
+    uses->paths[uses->count] = normalise_path(cwd, name);
+    uses->writes[uses->count] = write;
+    uses->count++;
+}
+
+//Adds every file node (a list, pipeline, subshell or command) may touch to uses
+static void collect_file_uses(struct command_node *node, const char *cwd, struct file_uses *uses)
+{
+    for (struct redirection *redir = node->redirs; redir != NULL; redir = redir->next) {
+        add_file_use(uses, cwd, redir->file, redir->type == REDIR_OUT || redir->type == REDIR_APPEND);
+    }
+
+    if (node->type != NODE_COMMAND) {
+        for (struct command_node *child = node->children; child != NULL; child = child->next) {
+            collect_file_uses(child, cwd, uses);
+        }
+        return;
+    }
+
+    if (strchr(node->argv[ARG_PROGNAME], '/')) {
+        add_file_use(uses, cwd, node->argv[ARG_PROGNAME], 0);
+    }
+    for (int i = 1; i < node->count; i++) {
+        if (node->argv[i][0] != '-' && node->argv[i][0] != '\0') {
+            add_file_use(uses, cwd, node->argv[i], 1);
+        }
+    }
+}
+
+//1 if a and b are the same file, or one is a directory holding the other
+static int same_or_inside(const char *a, const char *b)
+{
+    size_t a_len = strlen(a);
+    size_t b_len = strlen(b);
+    if (a_len > b_len) {
+        const char *swap = a; a = b; b = swap;
+        size_t swap_len = a_len; a_len = b_len; b_len = swap_len;
+    }
+    return strncmp(a, b, a_len) == 0 && (b_len == a_len || b[a_len] == '/' || a_len == 1);
+}
+
+//1 if two entries touch a common file and at least one of them may write it
+static int uses_conflict(const struct file_uses *a, const struct file_uses *b)
+{
+    for (int i = 0; i < a->count; i++) {
+        for (int j = 0; j < b->count; j++) {
+            if ((a->writes[i] || b->writes[j]) && same_or_inside(a->paths[i], b->paths[j])) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+//1 if node (a pipeline, subshell or command) may touch files collect_file_uses() can't
+//list: some command has no file arguments, or a subshell runs cd
+static int has_hidden_uses(struct command_node *node)
+{
+    if (node->type != NODE_COMMAND) {
+        for (struct command_node *child = node->children; child != NULL; child = child->next) {
+            if (has_hidden_uses(child)) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    if (strcmp(node->argv[ARG_PROGNAME], "cd") == 0) {
+        return 1;
+    }
+    for (int i = 1; i < node->count; i++) {
+        if (node->argv[i][0] != '-' && node->argv[i][0] != '\0') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//Entries the scheduler may move: plain ';' entries that don't change the shell itself
+//and whose files are all named
+static int is_schedulable(struct command_node *entry)
+{
+    static const char *barriers[] = {"cd", "exit", "set", "hash", "wait", "jobs"};
+
+    if (entry->op != OP_SEQUENCE || entry->timed || entry->cached) {
+        return 0;
+    }
+    struct command_node *stage = entry->children;
+    for (; stage != NULL; stage = stage->next) {
+        if (stage->has_status) {
+            return 0; //$? needs the entries before it to have finished
+        }
+    }
+    if (has_hidden_uses(entry)) {
+        return 0;
+    }
+    stage = entry->children;
+    if (entry->count == 1 && stage->type == NODE_COMMAND) {
+        for (size_t i = 0; i < sizeof(barriers) / sizeof(barriers[0]); i++) {
+            if (strcmp(stage->argv[ARG_PROGNAME], barriers[i]) == 0) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * launch_scheduled
+ * 
+ * Runs count consecutive schedulable entries, starting each as soon as the entries it
+ * conflicts with have finished (see "Batch scheduler" above).
+ * 
+ * Returns the exit status of the last entry, as with ';'
+ */
+static int launch_scheduled(struct command_node *first, int count, char lwd[])
+{
+    char *cwd = getcwd(NULL, 0);
+    struct file_uses *uses = calloc(count, sizeof(struct file_uses));
+    unsigned char *after = calloc((size_t) count * count, 1);
+    if (!cwd || !uses || !after) {
+        //Can't tell what is safe: run them one after another
+        free(cwd);
+        free(uses);
+        free(after);
+        int status = 0;
+        for (int i = 0; i < count; i++, first = first->next) {
+            status = run_list_entry(first, lwd);
+        }
+        return status;
+    }
+
+    struct command_node *entry = first;
+    for (int j = 0; j < count; j++, entry = entry->next) {
+        collect_file_uses(entry, cwd, &uses[j]);
+        for (int i = 0; i < j; i++) {
+            after[j * count + i] = uses_conflict(&uses[i], &uses[j]);
+        }
+    }
+
+    int status = run_concurrently(first, count, after, get_option(OPT_JOBS), lwd, NULL);
+
+    for (int i = 0; i < count; i++) {
+        for (int k = 0; k < uses[i].count; k++) {
+            free(uses[i].paths[k]);
+        }
+        free(uses[i].paths);
+        free(uses[i].writes);
+    }
+    free(uses);
+    free(after);
+    free(cwd);
+    return status;
+}
+
+//1 if the entry after an entry ending in op runs, given the status so far.
+//A skipped entry leaves $? alone, and its own op decides about the entry after it, so
+//"false && a && b || c" skips a and b and runs c.
+static int should_run(enum ListOp prev_op)
+{
+    return !(prev_op == OP_AND && last_status != 0) && !(prev_op == OP_OR && last_status == 0);
+}
+
+//Runs (or, after a failed && / successful ||, skips) the list entry at entry, '&' and '&&&'
+//included, and sets last_status and *prev_op. Returns the entry to run next.
+static struct command_node *run_list_step(struct command_node *entry, char lwd[], enum ListOp *prev_op)
+{
+    if (!should_run(*prev_op)) {
+        //skipped
+    } else if (entry->op == OP_BACKGROUND) {
+        expand_entry_status(entry);
+        last_status = launch_background(entry, lwd);
+    } else if (entry->op == OP_PARALLEL) {
+        //Every entry of the group sees the $? from before the group
+        struct command_node *member = entry;
+        while (1) {
+            expand_entry_status(member);
+            if (member->op != OP_PARALLEL || member->next == NULL) {
+                break;
+            }
+            member = member->next;
+        }
+        last_status = launch_parallel_group(entry, lwd);
+        entry = member;
+    } else {
+        expand_entry_status(entry);
+        last_status = run_list_entry(entry, lwd);
+    }
+    *prev_op = entry->op;
+    return entry->next;
+}
+
+//Runs the list entries from entry to the end of the list. Returns the last exit status.
+static int run_list_from(struct command_node *entry, char lwd[])
+{
+    enum ListOp prev_op = OP_SEQUENCE;
+    while (entry != NULL) {
+        //With "set schedule=1", runs of two or more plain entries that are sure to run
+        //go to the scheduler
+        int count = 0;
+        if (get_option(OPT_SCHEDULE) && prev_op != OP_AND && prev_op != OP_OR) {
+            for (struct command_node *next = entry; next != NULL && is_schedulable(next); next = next->next) {
+                count++;
+            }
+        }
+        if (count < 2) {
+            entry = run_list_step(entry, lwd, &prev_op);
+            continue;
+        }
+        last_status = launch_scheduled(entry, count, lwd);
+        while (count-- > 0) {
+            prev_op = entry->op;
+            entry = entry->next;
+        }
+    }
+    return last_status;
+}
+
+// Executes a list of pipelines sequentially; '&&' and '||' skip entries based on the
+// exit status of the previous one, which is also what $? expands to
+// Each entry can be basic, have redirection, use pipes, be a subshell or be a cd command,
+// and can be started in the background ('&') or run in a parallel group ('&&&')
+// Returns the exit status of the last entry that ran
+int launch_batched_commands(struct command_node *list, char lwd[])
+{
+    if (!tracing()) {
+        return run_list_from(list->children, lwd);
+    }
+
+    long long start = monotonic_ns();
+    int status = run_list_from(list->children, lwd);
+    trace_begin("list");
+    trace_int("entries", list->count);
+    trace_int("status", status);
+    trace_int("dur_ns", monotonic_ns() - start);
+    trace_end();
+    return status;
+}
+
+/**
+ * exec_batched_commands
+ * 
+ * Like launch_batched_commands, for a process that exits as soon as the list is done:
+ * a forked subshell, or s3 run as ./s3 "cmd".
+ * There is no point forking the last command and waiting for it, so (like dash and bash)
+ * a final simple command replaces this process with exec, and a final subshell is
+ * evaluated right here. That saves one process per subshell and per one-shot invocation.
+ * 
+ * Never returns.
+ */
+void exec_batched_commands(struct command_node *list, char lwd[])
+{
+    //Everything but a final plain entry runs as usual
+    enum ListOp prev_op = OP_SEQUENCE;
+    struct command_node *pipeline = list->children;
+    while (pipeline != NULL && (pipeline->next != NULL || pipeline->op != OP_SEQUENCE)) {
+        if (get_option(OPT_SCHEDULE) && prev_op != OP_AND && prev_op != OP_OR) {
+            //The scheduler needs the rest of the list, so there is no exec-tail with it
+            shell_exit(run_list_from(pipeline, lwd));
+        }
+        pipeline = run_list_step(pipeline, lwd, &prev_op);
+    }
+    if (pipeline == NULL || !should_run(prev_op)) {
+        shell_exit(last_status);
+    }
+
+    expand_entry_status(pipeline);
+    struct command_node *stage = pipeline->children;
+    if (pipeline->count > 1 || pipeline->timed || pipeline->cached
+        || (stage->type == NODE_COMMAND && is_shell_builtin(stage->argv[ARG_PROGNAME]))) {
+        shell_exit(run_list_entry(pipeline, lwd));
+    }
+
+    //The last entry is a simple command or a subshell: set up its redirections on this process
+    int redir_in = -1;
+    int redir_out = -1;
+    if (!open_redirections(stage->redirs, &redir_in, &redir_out)) {
+        shell_exit(1);
+    }
+    move_fd(redir_in, STDIN_FILENO);
+    move_fd(redir_out, STDOUT_FILENO);
+
+    if (stage->type == NODE_SUBSHELL) {
+        exec_batched_commands(stage->children, lwd); //this process is already isolated
+    }
+    exec_program(external_argv(stage));
+}
+
+/**
+ * launch_subshell
+ * 
+ * Forks once and evaluates the subshell's (already parsed) body directly in the child.
+ * The child execs its last command instead of forking again (see exec_batched_commands).
+ * Used both for standalone subshells and for subshell stages of a pipeline.
+ * 
+ * subshell = NODE_SUBSHELL from the command tree
+ * in_fd = fd for the child's stdin, or -1 to inherit
+ * out_fd = fd for the child's stdout, or -1 to inherit
+ * unused_fd = fd the child must close (the read end of its own output pipe), or -1
+ * lwd[] = last working directory, so "cd -" inside the subshell behaves like in the parent
+ * 
+ * Returns the pid of the child (caller waits for it), or -1 if fork failed.
+ */
+pid_t launch_subshell(struct command_node *subshell, int in_fd, int out_fd, int unused_fd, char lwd[])
+{
+    fflush(stdout); //don't let the child inherit (and re-print) buffered output
+    mark_launch();
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        perror("fork failed");
+        return -1;
+    }
+
+    if (pid == 0) { // Child process: set up I/O, evaluate the body and exit
+        clear_jobs();
+        setup_child_io(subshell->redirs, in_fd, out_fd, unused_fd);
+        exec_batched_commands(subshell->children, lwd);
+    }
+    count_stat(STAT_SUBSHELLS);
+    note_fork(pid, "subshell");
+    return pid;
+}
+
+/**
+ * Tracing (--trace FILE or S3_TRACE=FILE)
+ * 
+ * Writes one JSON object per line for every parse, spawn, fork, exec, redirection, pipe,
+ * child exit, builtin, pipeline and list, e.g.
+ *   {"ts_ns":81237742113,"pid":4242,"event":"spawn","child":4243,"argv":["sort","big"],...}
+ * ts_ns is CLOCK_MONOTONIC, shared by the shell and all its children, so the lines of
+ * forked subshells merge into one timeline. Every event is built in a buffer and written
+ * with a single write() to an O_APPEND fd, so lines from different processes never mix.
+ * When tracing is off each call site costs one check of tracing().
+ */
+static int trace_fd = -1;
+static char *trace_buffer = NULL;
+static size_t trace_length = 0;
+static size_t trace_capacity = 0;
+
+//Opens the trace file (appending). Returns 0 after printing why if it can't be opened.
+int init_trace(const char *path)
+{
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (trace_fd == -1) {
+        perror(path);
+        return 0;
+    }
+    return 1;
+}
+
+int tracing(void)
+{
+    return trace_fd != -1;
+}
+
+long long monotonic_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void trace_append(const char *text, size_t len)
+{
+    if (trace_length + len > trace_capacity) {
+        trace_capacity = (trace_length + len) * 2;
+        trace_buffer = realloc(trace_buffer, trace_capacity);
+        if (!trace_buffer) {
+            perror("malloc failed");
+            exit(1);
+        }
+    }
+    memcpy(trace_buffer + trace_length, text, len);
+    trace_length += len;
+}
+
+//Appends text as a JSON string (quoted and escaped)
+static void trace_string(const char *text)
+{
+    trace_append("\"", 1);
+    for (; *text; text++) {
+        char escaped[8];
+        unsigned char ch = *text;
+        if (ch == '"' || ch == '\\') {
+            escaped[0] = '\\';
+            escaped[1] = ch;
+            trace_append(escaped, 2);
+        } else if (ch < 0x20) {
+            trace_append(escaped, snprintf(escaped, sizeof(escaped), "\\u%04x", ch));
+        } else {
+            trace_append(text, 1);
+        }
+    }
+    trace_append("\"", 1);
+}
+
+static void trace_key(const char *key)
+{
+    trace_append(",", 1);
+    trace_string(key);
+    trace_append(":", 1);
+}
+
+//Starts an event line; add fields with trace_int/trace_str/trace_argv, then trace_end()
+void trace_begin(const char *event)
+{
+    char head[64];
+    trace_length = 0;
+    trace_append(head, snprintf(head, sizeof(head), "{\"ts_ns\":%lld,\"pid\":%d", monotonic_ns(), (int) getpid()));
+    trace_key("event");
+    trace_string(event);
+}
+
+void trace_int(const char *key, long long value)
+{
+    char number[32];
+    trace_key(key);
+    trace_append(number, snprintf(number, sizeof(number), "%lld", value));
+}
+
+void trace_str(const char *key, const char *value)
+{
+    trace_key(key);
+    trace_string(value);
+}
+
+void trace_argv(const char *key, char *argv[])
+{
+    trace_key(key);
+    trace_append("[", 1);
+    for (int i = 0; argv[i] != NULL; i++) {
+        if (i > 0) {
+            trace_append(",", 1);
+        }
+        trace_string(argv[i]);
+    }
+    trace_append("]", 1);
+}
+
+void trace_end(void)
+{
+    trace_append("}\n", 2);
+    if (write(trace_fd, trace_buffer, trace_length) == -1) {
+        //a trace that can't be written must not break the commands being traced
+    }
+}
+
+/**
+ * Statistics ("s3stat")
+ * 
+ * Counters that are always on: each one is an increment of a static array, and the only
+ * clock reads are the ones around parse_line() and the ones jobs already do for "time".
+ * They count what this shell process did; work done inside forked subshells is counted in
+ * the subshell's own copy and lost when it exits (its fork, and its exit latency, are
+ * counted here).
+ */
+static const char *stat_names[STAT_COUNT] = {
+    [STAT_COMMANDS] = "commands", [STAT_FORKS] = "forks", [STAT_EXECS] = "execs",
+    [STAT_PATH_HITS] = "path_hits", [STAT_PATH_MISSES] = "path_misses",
+    [STAT_BUILTINS] = "builtins", [STAT_PIPES] = "pipes", [STAT_SUBSHELLS] = "subshells",
+    [STAT_PARSES] = "parses", [STAT_CACHE_HITS] = "cache_hits", [STAT_CACHE_MISSES] = "cache_misses",
+    [STAT_ZYGOTES] = "zygotes",
+};
+static long stat_counts[STAT_COUNT];
+static long long parse_ns = 0;
+
+///Spawn-to-exit latency of reaped children, by power of 10: <10us, <100us, ... <10s, >=10s
+#define LATENCY_BUCKETS 8
+static long latency_counts[LATENCY_BUCKETS];
+static const char *latency_names[LATENCY_BUCKETS] = {
+    "<10us", "<100us", "<1ms", "<10ms", "<100ms", "<1s", "<10s", ">=10s",
+};
+
+void count_stat(enum StatCounter counter)
+{
+    stat_counts[counter]++;
+}
+
+void count_parse(long long ns)
+{
+    stat_counts[STAT_PARSES]++;
+    parse_ns += ns;
+}
+
+void count_latency(long long ns)
+{
+    int bucket = 0;
+    for (long long limit = 10000; ns >= limit && bucket < LATENCY_BUCKETS - 1; limit *= 10) {
+        bucket++;
+    }
+    latency_counts[bucket]++;
+}
+
+/**
+ * builtin_s3stat
+ * 
+ * s3stat [-j] [-r]
+ * Prints the counters as a table, or as one JSON object with -j. -r sets them all back
+ * to zero (after printing them, if combined with -j).
+ * 
+ * Returns 0, or 2 for an unknown option.
+ */
+int builtin_s3stat(char *args[], int argsc)
+{
+    int json = 0, reset = 0, print = 1;
+    for (int i = 1; i < argsc; i++) {
+        if (strcmp(args[i], "-j") == 0) {
+            json = 1;
+        } else if (strcmp(args[i], "-r") == 0) {
+            reset = 1;
+            print = 0;
+        } else {
+            fprintf(stderr, "s3stat: usage: s3stat [-j] [-r]\n");
+            return 2;
+        }
+    }
+    print = print || json;
+
+    if (print && json) {
+        printf("{");
+        for (int i = 0; i < STAT_COUNT; i++) {
+            printf("\"%s\":%ld,", stat_names[i], stat_counts[i]);
+        }
+        printf("\"parse_ns\":%lld,\"latency\":{", parse_ns);
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            printf("%s\"%s\":%ld", i > 0 ? "," : "", latency_names[i], latency_counts[i]);
+        }
+        printf("}}\n");
+    } else if (print) {
+        for (int i = 0; i < STAT_COUNT; i++) {
+            printf("%-12s %ld\n", stat_names[i], stat_counts[i]);
+        }
+        printf("%-12s %.3f ms", "parse time", parse_ns / 1e6);
+        if (stat_counts[STAT_PARSES] > 0) {
+            printf(" (%.1f us per line)", parse_ns / 1e3 / stat_counts[STAT_PARSES]);
+        }
+        printf("\nspawn-to-exit latency:\n");
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            printf("  %-10s %ld\n", latency_names[i], latency_counts[i]);
+        }
+    }
+
+    if (reset) {
+        memset(stat_counts, 0, sizeof(stat_counts));
+        memset(latency_counts, 0, sizeof(latency_counts));
+        parse_ns = 0;
+    }
+    return 0;
+}
+
+/**
+ * Server mode (./s3 --serve SOCKET)
+ * 
+ * Listens on a Unix domain socket (SOCK_SEQPACKET, so every message is one frame) and
+ * runs command lines for its clients. Each connection is a session: a fork of the server
+ * with its own cwd, lwd, jobs and $?, and a warm copy of the server's state (PATH cache,
+ * options) instead of a fresh ./s3 start. Sessions run concurrently.
+ * 
+ * Client -> server: one message per command line, the text without a newline, with the
+ *                   client's stdin, stdout and stderr attached as SCM_RIGHTS (a message
+ *                   without fds keeps the previous ones).
+ * Server -> client: struct server_frame {kind, value}:
+ *                   SERVER_STATUS after every command line (value = its exit status)
+ *                   SERVER_EXIT once the session is over ("exit", or the client hung up)
+ * client/s3client.c is a client that runs its arguments as command lines.
+ */
+enum ServerFrameKind
+{
+    SERVER_STATUS,
+    SERVER_EXIT,
+};
+
+struct server_frame
+{
+    int kind;
+    int value;
+};
+
+//Sends one frame, ignoring a client that has gone away
+static void send_frame(int fd, int kind, int value)
+{
+    struct server_frame frame = { .kind = kind, .value = value };
+    if (send(fd, &frame, sizeof(frame), MSG_NOSIGNAL) == -1) {
+        //the client hung up, the session ends with the next read
+    }
+}
+
+//Body of a session: runs each command line the client sends. Never returns.
+static void serve_client(int conn, char lwd[])
+{
+    static char line[SERVER_MESSAGE_MAX + 1];
+    struct arena arena = {0};
+
+    while (1) {
+        char control[CMSG_SPACE(3 * sizeof(int))];
+        struct iovec iov = { .iov_base = line, .iov_len = SERVER_MESSAGE_MAX };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+        fill_zygotes(); //while the client has nothing for us
+        ssize_t length = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+        if (length <= 0) {
+            shell_exit(last_status); //client hung up
+        }
+        line[length] = '\0';
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(3 * sizeof(int))) {
+            int fds[3];
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+            fflush(stdout);
+            for (int i = 0; i < 3; i++) {
+                move_fd(fds[i], i);
+            }
+        }
+
+        if (msg.msg_flags & MSG_TRUNC) {
+            fprintf(stderr, "s3: command line longer than %d bytes\n", SERVER_MESSAGE_MAX);
+            last_status = 2;
+        } else {
+            struct command_node *tree = parse_line(line, &arena);
+            last_status = tree ? launch_batched_commands(tree, lwd) : 2;
+            arena_reset(&arena);
+        }
+        fflush(stdout);
+        send_frame(conn, SERVER_STATUS, last_status);
+    }
+}
+
+/**
+ * run_server
+ * 
+ * Binds socket_path (replacing a stale socket file) and serves clients until killed.
+ * The server itself only accepts connections and reaps sessions: when one ends, its exit
+ * status goes to the client as SERVER_EXIT.
+ * 
+ * A session runs anything as the server's user, so only that user may connect: the socket
+ * is created with mode 0600, and a peer whose SO_PEERCRED uid is another one is dropped
+ * (the mode alone doesn't hold for root, or for a socket in a directory shared with
+ * someone who can replace it).
+ * 
+ * Returns 1 if the socket can't be set up.
+ */
+int run_server(const char *socket_path, char lwd[])
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    struct stat st;
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(socket_path); //left behind by a server that was killed
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    mode_t saved_umask = umask(0177); //bind() creates the socket file with mode 0600
+    int bound = listen_fd != -1 && bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == 0;
+    umask(saved_umask);
+    if (!bound || listen(listen_fd, SOMAXCONN) == -1) {
+        perror(socket_path);
+        return 1;
+    }
+
+    //Sessions still running: pid and the server's end of their connection
+    pid_t *pids = NULL;
+    int *conns = NULL;
+    int count = 0;
+    int capacity = 0;
+
+    while (1) {
+        struct pollfd pfds[2] = {
+            { .fd = listen_fd, .events = POLLIN },
+            { .fd = sigchld_fd, .events = POLLIN },
+        };
+        if (poll(pfds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            perror("poll failed");
+            return 1;
+        }
+
+        if (pfds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            while (read(sigchld_fd, &info, sizeof(info)) == sizeof(info)) {
+            }
+            int status;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                for (int i = 0; i < count; i++) {
+                    if (pids[i] == pid) {
+                        send_frame(conns[i], SERVER_EXIT, WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+                        close(conns[i]);
+                        count--;
+                        pids[i] = pids[count];
+                        conns[i] = conns[count];
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (conn == -1) {
+                continue;
+            }
+            struct ucred peer = { .uid = (uid_t) -1 };
+            socklen_t peer_length = sizeof(peer);
+            if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &peer, &peer_length) == -1 || peer.uid != geteuid()) {
+                fprintf(stderr, "%s: refused a connection from uid %d\n", socket_path, (int) peer.uid);
+                close(conn);
+                continue;
+            }
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                pids = realloc(pids, capacity * sizeof(pid_t));
+                conns = realloc(conns, capacity * sizeof(int));
+                if (!pids || !conns) {
+                    perror("malloc failed");
+                    exit(1);
+                }
+            }
+
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid == 0) {
+                close(listen_fd);
+                for (int i = 0; i < count; i++) {
+                    close(conns[i]);
+                }
+                serve_client(conn, lwd);
+            }
+            if (pid == -1) {
+                perror("fork failed");
+                close(conn);
+                continue;
+            }
+            count_stat(STAT_FORKS);
+            pids[count] = pid;
+            conns[count] = conn;
+            count++;
+        }
+    }
+}
@@ -1,8 +1,14 @@
 #ifndef _S3_H_
 #define _S3_H_
 
+///Needed for pipe2() and O_CLOEXEC pipes (must come before any system header)
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 ///See reference for what these libraries provide
 #include <stdio.h>
+#include <stdio_ext.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -10,11 +16,35 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <limits.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+#include <spawn.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/prctl.h>
+
+///The environment of the shell, handed to every program we spawn
+extern char **environ;
 
 ///Constants for array sizes, defined for clarity and code readability
-#define MAX_LINE 1024
-#define MAX_ARGS 128
-#define MAX_PROMPT_LEN 256
+///(command lines, argument lists, pipelines and batches have no fixed limit)
+#define LWD_SIZE PATH_MAX //longest path getcwd() can return, so any directory fits
+#define PATH_CACHE_SIZE 256 //slots in the PATH lookup hash table (power of two)
+#define ARENA_BLOCK_SIZE 8192 //bytes per block of the per-line arena
+#define SCRIPT_BUFFER_SIZE (1 << 20) //stdio buffer for script/stdin input
+#define MAX_SUBSHELL_DEPTH 1000 //deepest ( ) nesting the parser accepts
+#define MAX_ZYGOTES 64 //most pre-forked helpers "set zygotes=N" keeps
+#define ZYGOTE_MESSAGE_MAX 65536 //largest cwd + path + argv a helper accepts
+#define SERVER_MESSAGE_MAX 65536 //longest command line a --serve client can send
 
 ///Enum for readable argument indices (use where required)
 enum ArgIndex
@@ -25,55 +55,218 @@ enum ArgIndex
     ARG_3,
 };
 
+///Command tree built by parse_line(). A line is a list of pipelines, a pipeline is a
+///list of stages, and a stage is either a simple command or a subshell (which holds a list).
+enum NodeType
+{
+    NODE_LIST, //pipelines separated by ';', '&', '&&&', '&&' or '||'
+    NODE_PIPELINE, //stages separated by '|'
+    NODE_SUBSHELL, //'(' list ')'
+    NODE_COMMAND, //simple command: argv plus redirections
+};
+
+enum RedirType
+{
+    REDIR_IN, // <
+    REDIR_OUT, // >
+    REDIR_APPEND, // >>
+    REDIR_CAT, // < made from "cat file |" by the pipeline rewrites: unreadable files read as empty
+};
+
+///How a list entry is joined to the one after it
+enum ListOp
+{
+    OP_SEQUENCE, // ';' or end of list: wait for it, then run the next entry
+    OP_BACKGROUND, // '&': start it and move on without waiting
+    OP_PARALLEL, // '&&&': run it at the same time as the next entry (see launch_parallel_group)
+    OP_AND, // '&&': run the next entry only if this one succeeded
+    OP_OR, // '||': run the next entry only if this one failed
+};
+
+struct redirection
+{
+    enum RedirType type;
+    char *file;
+    struct redirection *next; //redirections are kept in the order they were written
+};
+
+struct command_node
+{
+    enum NodeType type;
+    struct command_node *next; //next sibling in the parent list/pipeline
+    struct command_node *children; //LIST/PIPELINE: first child, SUBSHELL: the body (a LIST)
+    int count; //LIST/PIPELINE: number of children, COMMAND: number of args
+    char **argv; //COMMAND: null terminated arguments
+    int has_status; //COMMAND, SUBSHELL: a word or redirection file holds $?, filled in just before it runs
+    struct redirection *redirs; //COMMAND/SUBSHELL: redirections
+    enum ListOp op; //list entries: operator written after this entry
+    char *text; //background entries: source text, shown by "jobs"
+    long pipe_size; //PIPELINE: "pipesize=N" written before it, 0 = use the pipesize option
+    int timed; //PIPELINE: "time" written before it
+    int cached; //PIPELINE: "cache" written before it
+};
+
+///Entry of the builtin table: commands run inside the shell instead of fork+exec
+struct builtin
+{
+    const char *name;
+    int (*run)(char *args[], int argsc); //returns the exit status
+};
+
+///A running pipeline (a standalone command or subshell is a one-stage pipeline)
+struct job
+{
+    pid_t *pids; //pid of each stage, -1 if it could not be started
+    int *statuses; //exit status of each stage, -1 while it is still running
+    struct rusage *usages; //resource usage of each stage from wait4(), zero until reaped
+    struct timespec *started; //CLOCK_MONOTONIC time each stage was started
+    struct timespec *finished; //CLOCK_MONOTONIC time each stage was reaped
+    int stage_count;
+    int stage_capacity;
+    int running; //stages that have not been reaped yet
+    int id; //background jobs: job number shown as [id], 0 for foreground jobs
+    char *text; //background jobs: the command line that started it (malloc'd)
+};
+
+///Settings changed with "set name=value"; read with get_option()
+enum ShellOption
+{
+    OPT_JOBS, //most entries of a '&&&' group or scheduled batch running at once (0 = number of CPUs)
+    OPT_SCHEDULE, //1 = run independent entries of ';' lists in parallel (see launch_scheduled)
+    OPT_REWRITE, //0 = turn off the pipeline rewrites (see rewrite_pipeline)
+    OPT_PLAN, //1 = print each pipeline the rewrites changed
+    OPT_PIPESIZE, //buffer size for pipes between stages (0 = kernel default)
+    OPT_CACHE_SIZE, //bytes the "cache" prefix may keep on disk before evicting old entries
+    OPT_ZYGOTES, //idle pre-forked helpers to exec programs with (0 = spawn them with posix_spawn)
+    OPT_COUNT,
+};
+
+///Counters shown by "s3stat"
+enum StatCounter
+{
+    STAT_COMMANDS, //simple commands run: programs started + builtins
+    STAT_FORKS, //fork()s of the shell itself (subshells, builtins in pipelines)
+    STAT_EXECS, //programs started with posix_spawn
+    STAT_PATH_HITS, //command names found in the PATH cache
+    STAT_PATH_MISSES, //command names that needed a $PATH search
+    STAT_BUILTINS, //builtins run inside the shell process, without a fork
+    STAT_PIPES, //pipes created between pipeline stages
+    STAT_SUBSHELLS, //( ) subshells forked, including wrapped background entries
+    STAT_PARSES, //lines parsed
+    STAT_CACHE_HITS, //"cache" pipelines replayed from the store
+    STAT_CACHE_MISSES, //"cache" pipelines that had to run
+    STAT_ZYGOTES, //programs exec'd by a pre-forked helper instead of posix_spawn
+    STAT_COUNT,
+};
+
+///Per-line memory for the command tree, everything is freed at once by arena_reset()
+struct arena_block;
+struct arena
+{
+    struct arena_block *head;
+};
+
 
 ///With inline functions, the compiler replaces the function call 
 ///with the actual function code;
 ///inline improves speed and readability; meant for short functions (a few lines).
 ///the static here avoids linker errors from multiple definitions (needed with inline).
-static inline void reap()
+
+///Leaves the shell, or a forked copy of it that was running shell code.
+///_exit() rather than exit(): exit() also "closes" a script FILE the child shares with the
+///parent, which seeks the shared fd back and makes the parent read the same lines again.
+__attribute__((noreturn)) static inline void shell_exit(int status)
 {
-    wait(NULL);
+    fflush(stdout);
+    _exit(status);
 }
 
 ///Shell I/O and related functions (add more as appropriate)
-void read_command_line(char line[], char lwd[]);
-void construct_shell_prompt(char shell_prompt[], char lwd[]);
-void parse_command(char line[], char *args[], int *argsc);
+void read_command_line(char **line, size_t *line_cap, char lwd[]);
+char *construct_shell_prompt(char lwd[]);
+int read_script_line(FILE *input, char **line, size_t *line_cap);
 
-///Child functions (add more as appropriate)
-void child(char *args[], int argsc);
+///Parser - one pass over the line, producing a command tree in the arena
+struct command_node *parse_line(const char line[], struct arena *arena);
+void *arena_alloc(struct arena *arena, size_t size);
+void arena_reset(struct arena *arena);
 
-///Program launching functions (add more as appropriate)
-void launch_program(char *args[], int argsc);
+///Spawn engine - every external program is started through this one function
+pid_t spawn_program(char *args[], int in_fd, int out_fd);
+__attribute__((noreturn)) void exec_program(char *args[]);
+void fill_zygotes(void); //tops up the "set zygotes=N" pool of pre-forked helpers
+
+///PATH lookup cache - command names are resolved once and the absolute path is reused
+const char *resolve_command(const char *name);
+void forget_command(const char *name);
+void clear_path_cache(void);
+int run_hash(char *args[], int argsc);
+
+///Builtins - echo, pwd, true, false, printf, test/[, hash, jobs, wait, set, parallel, cat and cp run without exec
+const struct builtin *find_builtin(const char *name);
+int run_builtin(const struct builtin *builtin, struct command_node *cmd);
+
+///Job table - children are reaped with waitpid() whenever the SIGCHLD signalfd fires
+void init_jobs(void);
+struct job *new_job(void);
+void mark_launch(void);
+void job_add_stage(struct job *job, pid_t pid);
+void free_job(struct job *job);
+void clear_jobs(void);
+void reap_children(void);
+int wait_for_job(struct job *job);
+int wait_for_pid(pid_t pid);
+void report_jobs(int verbose);
 
-//Redirection helpers - The three functions below are to implement the redirection functionality.
-int command_with_redirection(char line[]);
-void launch_program_with_redirection(char *args[], int argsc);
+///Shell options - "set" lists them, "set jobs=4" changes one
+long get_option(enum ShellOption option);
+int set_option(const char *name, const char *value);
+int parse_option_value(const char *value, long *number);
 
-//Extra helper function
-int find_redirection(char *tokens[], int count, char **file, int *append, int *input);
+///Program launching functions (add more as appropriate)
+int launch_program(struct command_node *cmd);
+pid_t spawn_command(struct command_node *cmd, int in_fd, int out_fd);
+
+//Redirection helper - opens a redirection target for a child's stdin/stdout
+int open_redirection(char *filename, int append, int input);
 
-//Pipe helpers - The three functions below are to implement the pipe functionality.
-int command_with_pipes(char line[]);
-int tokenize_pipeline(char line[], char *commands[], int *command_count);
-void launch_pipeline(char *commands[], int command_count);
+//Pipe helper
+int launch_pipeline(struct command_node *pipeline, char lwd[]);
+struct job *start_pipeline(struct command_node *pipeline, int out_fd, char lwd[]);
 //I'm writing general-purpose helpers so that the main loop stays readable. 
 
 
-int is_cd(const char *line);
 void init_lwd(char lwd[]);
 int run_cd(char *args[], int argsc, char lwd[]);
 
 
-//Batched command helpers
-int command_with_batch(char line[]);
-int tokenize_batched_commands(char line[], char *commands[], int *command_count);
-void launch_batched_commands(char *commands[], int command_count, char lwd[]);
+//Batched command helper
+int launch_batched_commands(struct command_node *list, char lwd[]);
+__attribute__((noreturn)) void exec_batched_commands(struct command_node *list, char lwd[]);
+int launch_parallel_group(struct command_node *first, char lwd[]);
+int builtin_parallel(char *args[], int argsc);
+
+
+//Subshell helper
+pid_t launch_subshell(struct command_node *subshell, int in_fd, int out_fd, int unused_fd, char lwd[]);
+
+//Tracing - one JSON line per event, to the file from --trace or S3_TRACE (see s3.c)
+int init_trace(const char *path);
+int tracing(void);
+long long monotonic_ns(void);
+void trace_begin(const char *event);
+void trace_int(const char *key, long long value);
+void trace_str(const char *key, const char *value);
+void trace_argv(const char *key, char *argv[]);
+void trace_end(void);
 
+//Statistics printed by the s3stat builtin (see s3.c)
+void count_stat(enum StatCounter counter);
+void count_parse(long long ns);
+void count_latency(long long ns);
+int builtin_s3stat(char *args[], int argsc);
 
-//Subshell helpers
-int command_with_subshell(char line[]);
-int extract_subshell_commands(char line[], char *subshell_cmd);
-void launch_subshell(char *subshell_cmd);
+//Server mode - ./s3 --serve SOCKET runs command lines sent by clients (see s3.c)
+int run_server(const char *socket_path, char lwd[]);
 
 #endif
\ No newline at end of file
@@ -1,129 +1,133 @@
 #include "s3.h"
 
 int main(int argc, char *argv[]){
-    ///Stores the command line input
-    char line[MAX_LINE];
+    ///Stores the command line input; grown by getline() to fit the longest line seen
+    char *line = NULL;
+    size_t line_cap = 0;
 
     ///The last (previous) working directory 
-    ///We set it to -6 to account for "[s3]$ " <- 6 characters which is defined in s3.c
-    ///Shell prompt is constructed in construct_shell_prompt() function
-    char lwd[MAX_PROMPT_LEN-6]; 
+    ///LWD_SIZE fits any path getcwd() can return
+    char lwd[LWD_SIZE]; 
 
     init_lwd(lwd);///Implement this function: initializes lwd with the cwd (using getcwd)
 
-    //Stores pointers to command arguments.
-    ///The first element of the array is the command name.
-    char *args[MAX_ARGS];
+    init_jobs(); ///Children are reaped through the job table from here on
 
-    ///Stores the number of arguments
-    int argsc;
+    ///Holds the command tree of the current line; reset (freed in one go) after every line
+    struct arena arena = {0};
 
-    //If shell is invoked with arguments, execute them as commands (for subshell execution)
-    if (argc > 1) {
-        //Shell was invoked as: ./s3 "cd txt ; ls"
-        //argv[1] contains the command string to execute
-        strncpy(line, argv[1], MAX_LINE - 1);
-        line[MAX_LINE - 1] = '\0';
-        
-        //Process the command using existing logic (order must match main loop)
-        if (command_with_batch(line)) {
-            char *batch_cmds[MAX_ARGS];
-            int batch_count = 0;
-            if (tokenize_batched_commands(line, batch_cmds, &batch_count)) {
-                launch_batched_commands(batch_cmds, batch_count, lwd);
-            }
+    ///Root of the command tree for the current line
+    struct command_node *tree;
+
+    ///Where commands come from when not running interactively (script file or piped stdin)
+    FILE *script = NULL;
+
+    //Tracing: S3_TRACE=file ./s3 ..., or ./s3 --trace file ... (below)
+    if (getenv("S3_TRACE") && !init_trace(getenv("S3_TRACE"))) {
+        return 2;
+    }
+
+    //Shell options before anything else (they also apply while lines are parsed):
+    //  ./s3 -j N ...           run up to N entries of a '&&&' group at once ("set jobs=N")
+    //  ./s3 -o name=value ...  same as "set name=value", e.g. -o plan=1
+    //  ./s3 --trace file ...   write a JSON line per fork/exec/pipe/exit... to file
+    while (argc > 2 && (strcmp(argv[1], "-j") == 0 || strcmp(argv[1], "-o") == 0
+                        || strcmp(argv[1], "--trace") == 0)) {
+        char *equals = strchr(argv[2], '=');
+        int ok;
+        if (argv[1][1] == '-') {
+            ok = init_trace(argv[2]);
+        } else if (argv[1][1] == 'j') {
+            ok = set_option("jobs", argv[2]);
+        } else if (equals) {
+            *equals = '\0';
+            ok = set_option(argv[2], equals + 1);
+        } else {
+            fprintf(stderr, "-o: expected name=value\n");
+            ok = 0;
         }
-        else if (is_cd(line)) {
-            parse_command(line, args, &argsc);
-            run_cd(args, argsc, lwd);
+        if (!ok) {
+            return 2;
         }
-        else if (command_with_pipes(line)) {
-            char *pipeline_cmds[MAX_ARGS];
-            int pipeline_count = 0;
-            if (tokenize_pipeline(line, pipeline_cmds, &pipeline_count)) {
-                launch_pipeline(pipeline_cmds, pipeline_count);
-            }
-            // reap() is now called inside launch_pipeline() for all children
+        argv[2] = argv[0]; //drop the option: the rest of main sees ./s3 [args]
+        argv += 2;
+        argc -= 2;
+    }
+
+    //Server mode: ./s3 --serve /path/to.sock (client/s3client sends it command lines)
+    if (argc == 3 && strcmp(argv[1], "--serve") == 0) {
+        return run_server(argv[2], lwd);
+    }
+
+    //Script mode:
+    //  ./s3 -s              -> read commands from stdin
+    //  ./s3 -s script.s3    -> read commands from the file
+    //  ./s3 script.s3       -> same, if the argument is one word ending in .s3 that names an
+    //                          existing regular file (anything else is a one-shot command)
+    struct stat script_st;
+    if (argc > 1 && strcmp(argv[1], "-s") == 0) {
+        script = (argc > 2) ? fopen(argv[2], "r") : stdin;
+        if (!script) {
+            perror(argv[2]);
+            return 1;
         }
-        else if (command_with_redirection(line)) {
-            parse_command(line, args, &argsc);
-            launch_program_with_redirection(args, argsc);
-            reap();
-            
+    } else if (argc > 1 && strlen(argv[1]) > 3 && strcmp(argv[1] + strlen(argv[1]) - 3, ".s3") == 0
+               && strpbrk(argv[1], " \t") == NULL && stat(argv[1], &script_st) == 0 && S_ISREG(script_st.st_mode)) {
+        script = fopen(argv[1], "r");
+        if (!script) {
+            perror(argv[1]);
+            return 1;
         }
-        //Checks for subshell and runs subshell. Allows for implementation of nested subshell
-        //Allows for commands like ((((echo "HI"))))
-        else if (command_with_subshell(line)) { 
-            char subshell_cmd[MAX_LINE];
-            //extracts subshell and laucnhes subshell
-            if (extract_subshell_commands(line, subshell_cmd)){
-                launch_subshell(subshell_cmd);
-            }
-            reap();
+    } else if (argc == 1 && !isatty(STDIN_FILENO)) {
+        //Commands piped in: no prompt to show, so stream them like a script
+        script = stdin;
+    }
+
+    if (script) {
+        //One big buffer instead of stdio's default 4 KiB, and no prompt per line
+        setvbuf(script, NULL, _IOFBF, SCRIPT_BUFFER_SIZE);
 
+        //Exits with the status of the last line, like ./s3 "cmd"; 2 if it didn't parse
+        int status = 0;
+        while (read_script_line(script, &line, &line_cap)) {
+            report_jobs(0); //forget finished background jobs quietly
+            fill_zygotes(); //"set zygotes=N": collects and asks for helpers, never waits
+            tree = parse_line(line, &arena);
+            status = tree ? launch_batched_commands(tree, lwd) : 2;
+            arena_reset(&arena);
         }
-        else {
-            parse_command(line, args, &argsc);
-            launch_program(args, argsc);
-            reap();
+        return status;
+    }
+
+    //If shell is invoked with arguments, execute them as commands
+    if (argc > 1) {
+        //Shell was invoked as: ./s3 "cd txt ; ls"
+        //argv[1] contains the command string to execute
+        fill_zygotes(); //only if -o zygotes=N
+        tree = parse_line(argv[1], &arena);
+        if (tree) {
+            //One-shot: the last command takes over this process instead of being forked
+            exec_batched_commands(tree, lwd);
         }
         
-        return 0; //Exit after executing the command (subshells are one-shot)
+        return 2; //The command didn't parse (exec_batched_commands never returns)
     }
 
     //Normal interactive shell mode
     while (1) {
 
-        read_command_line(line, lwd); ///Notice the additional parameter (required for prompt construction)
-
-        if(command_with_batch(line)){
-            char *batch_cmds[MAX_ARGS];
-            int batch_count = 0;
-
-            if (tokenize_batched_commands(line, batch_cmds, &batch_count)) {
-                launch_batched_commands(batch_cmds, batch_count, lwd);
-            } else {
-                fprintf(stderr, "Batch parse error\n");
-            }
-        }
-        else if(is_cd(line)){///Implement this function
-            parse_command(line, args, &argsc);
-            run_cd(args, argsc, lwd);
-        }
-        else if(command_with_pipes(line)){
-            char *pipeline_cmds[MAX_ARGS];
-            int pipeline_count = 0;
+        report_jobs(1); //"[1] Done ..." for background jobs that finished since the last line
+        fill_zygotes(); //"set zygotes=N": asks for helpers, doesn't wait for them
 
-            if (tokenize_pipeline(line, pipeline_cmds, &pipeline_count)) {
-                launch_pipeline(pipeline_cmds, pipeline_count);
-            } else {
-                fprintf(stderr, "Pipeline parse error\n");
-            }
+        read_command_line(&line, &line_cap, lwd); ///Notice the additional parameter (required for prompt construction)
 
-            // reap() is now called inside launch_pipeline() for all children
-        }
-        else if(command_with_redirection(line)){
-            ///Command with redirection
-           parse_command(line, args, &argsc);
-           launch_program_with_redirection(args, argsc);
-           reap();
-        } 
-       else if(command_with_subshell(line)){
-            char subshell_cmd[MAX_LINE];
-
-            if (extract_subshell_commands(line, subshell_cmd)){
-                launch_subshell(subshell_cmd);
-            } else {
-                fprintf(stderr, "Subshell command syntax error\n");
-            }
-            reap();
+        //One pass over the line builds the whole tree (list -> pipelines -> stages),
+        //then we execute from the tree. Errors are reported by the parser.
+        tree = parse_line(line, &arena);
+        if (tree) {
+            launch_batched_commands(tree, lwd);
         }
-       else ///Basic command
-       {
-           parse_command(line, args, &argsc);
-           launch_program(args, argsc);
-           reap();
-       }
+        arena_reset(&arena);
     }
 
     return 0;